@@ -0,0 +1,132 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <memory>
+
+using namespace std;
+
+#include "common.h"
+
+struct BatchRun
+{
+    string input, expected; // expected output, none if empty
+    string status;
+    string log; // diagnostics of the simulator
+    uint64_t clocks;
+    double seconds;
+};
+
+static bool read_file(const string &name, string &content)
+{
+    ifstream ifs(name, ios::binary);
+    if (!ifs)
+        return false;
+    ostringstream ss;
+    ss << ifs.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+// one Simulator per run on the shared program, with its own CPU and I/O;
+// its diagnostics are kept in run.log
+static void run_one(BatchRun &run, shared_ptr<const Program> program, const Simulator::Options &options,
+                    uint64_t max_clocks, bool is_watchdog)
+{
+    auto start_time = chrono::steady_clock::now();
+    run.clocks = 0;
+
+    ostringstream log;
+    Simulator sim(options, log);
+    string error;
+    if (!sim.load(program, error)) {
+        report_error(error, log);
+        run.status = "NOLOAD";
+    }
+    else if (!sim.io().open_input(run.input))
+        run.status = "NOINPUT";
+    else {
+        sim.io().capture_output();
+        CPU *cpu = sim.get_cpu();
+        bool is_stopped;
+        bool res = run_budgeted(&sim, max_clocks, is_watchdog, is_stopped);
+        run.clocks = cpu->get_clocks();
+
+        string expected;
+        if (!res || cpu->is_exception())
+            run.status = "ERROR";
+        else if (run.expected.empty())
+            run.status = "DONE";
+        else if (!read_file(run.expected, expected))
+            run.status = "NOEXPECT";
+        else
+            run.status = sim.io().get_captured() == expected ? "PASS" : "FAIL";
+    }
+    run.log = log.str();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    run.seconds = elapsed.count();
+}
+
+// list lines are "INPUT [EXPECTED_OUTPUT]"; # starts a comment
+int run_batch(const string &list_name, const string &zoi_name, const Simulator::Options &options, unsigned jobs,
+              uint64_t max_clocks, bool is_watchdog)
+{
+    ifstream ifs(list_name);
+    if (!ifs) {
+        report_error("no such batch list");
+        return 1;
+    }
+    vector<BatchRun> runs;
+    string line;
+    while (getline(ifs, line)) {
+        vector<string> fields = split_string(line.substr(0, line.find('#')), " \t\r");
+        if (fields.empty())
+            continue;
+        if (fields.size() > 2) {
+            report_error("invalid batch list line: " + line);
+            return 1;
+        }
+        runs.push_back({fields[0], fields.size() == 2 ? fields[1] : "", "", "", 0, 0});
+    }
+
+    string error;
+    shared_ptr<const Program> program = Program::load(zoi_name, error);
+    if (!program) {
+        report_error(error);
+        return 1;
+    }
+
+    auto start_time = chrono::steady_clock::now();
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (unsigned i = 0; i < min<size_t>(jobs, runs.size()); i++) {
+        workers.push_back(thread([&]() {
+            for (size_t k; (k = next++) < runs.size(); )
+                run_one(runs[k], program, options, max_clocks, is_watchdog);
+        }));
+    }
+    for (thread &t : workers)
+        t.join();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
+    cerr << endl << "[Batch]" << endl;
+    size_t passed = 0, failed = 0;
+    for (const BatchRun &run : runs) {
+        cerr << left << setfill(' ') << setw(10) << run.status << right << setw(14) << run.clocks << " clks "
+             << fixed << setprecision(3) << setw(9) << run.seconds << " s  " << defaultfloat << run.input << endl;
+        for (const string &line : split_string(run.log, "\n"))
+            cerr << "    " << line << endl;
+        if (run.status == "PASS" || run.status == "DONE")
+            passed++;
+        else
+            failed++;
+    }
+    cerr << endl << runs.size() << " runs, " << passed << " ok, " << failed << " failed ("
+         << fixed << setprecision(2) << elapsed.count() << " s on " << jobs << " threads)." << defaultfloat << endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,377 @@
+#include <cmath>
+#include <cfenv>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+#include "common.h"
+
+static inline uint32_t float_to_bits(float x)
+{
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static inline float bits_to_float(uint32_t u)
+{
+    float x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+bool is_block_end(InstType t)
+{
+    switch (t) {
+        case InstType::jalr:
+        case InstType::beq:
+        case InstType::bne:
+        case InstType::blt:
+        case InstType::bge:
+        case InstType::jal:
+        case InstType::halt:
+        case InstType::sentinel:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the entry, static branch targets and the instructions following a block end
+vector<bool> find_leaders(const vector<DecodedInst> &dinsts)
+{
+    uint32_t text_len = dinsts.size();
+    vector<bool> is_leader(text_len, false);
+
+    if (text_len > 0)
+        is_leader[0] = true;
+    for (uint32_t i = 0; i < text_len; i++) {
+        InstType t = dinsts[i].type;
+        if (!is_block_end(t))
+            continue;
+        if (i + 1 < text_len)
+            is_leader[i + 1] = true;
+        if (t == InstType::jal || t == InstType::beq || t == InstType::bne || t == InstType::blt || t == InstType::bge) {
+            uint32_t target = ((i << 2) + dinsts[i].imm) >> 2;
+            if (target < text_len)
+                is_leader[target] = true;
+        }
+    }
+    return is_leader;
+}
+
+void BlockCache::build(const vector<DecodedInst> &dinsts)
+{
+    blocks.clear();
+    code.clear();
+    block_at.assign(dinsts.size(), -1);
+    is_leader = find_leaders(dinsts);
+}
+
+// Blocks are translated lazily. A jalr into the middle of a block starts a
+// new, overlapping one. handlers[INST_LEN + 1] ends a block that falls through.
+int32_t BlockCache::block_of(const vector<DecodedInst> &dinsts, uint32_t idx, const void *const *handlers)
+{
+    if (block_at[idx] >= 0)
+        return block_at[idx];
+
+    uint32_t end = idx;
+    while (!is_block_end(dinsts[end].type) && end + 1 < dinsts.size() && !is_leader[end + 1])
+        end++;
+
+    Block b;
+    b.start = idx;
+    b.len = end - idx + 1;
+    b.count = 0;
+    b.code = code.size();
+    for (uint32_t i = idx; i <= end; i++) {
+        const DecodedInst &d = dinsts[i];
+        code.push_back({handlers[static_cast<int>(d.type)], d.rd, d.rs1, d.rs2, d.imm});
+    }
+    code.push_back({handlers[INST_LEN + 1], 0, 0, 0, 0});
+
+    blocks.push_back(b);
+    block_at[idx] = blocks.size() - 1;
+    return block_at[idx];
+}
+
+// Runs whole basic blocks from the translation cache. Instructions inside a
+// block carry no bookkeeping at all: entering a block bumps one counter, and
+// statistics, coverage and clocks are derived from the counters when the loop
+// is left (flush_block_counters). A block left midway (halt, exception,
+// invalid instruction) is accounted instruction by instruction, and the
+// instruction it stopped at is handed to step_exec for the usual report.
+bool CPU::run_blocks(const vector<DecodedInst> &dinsts, uint64_t max_clocks)
+{
+    static const void *const handlers[] = {
+        &&op_add, &&op_sub, &&op_or_, &&op_fadd, &&op_fsub, &&op_fmul, &&op_fsqrt, &&op_fdiv,
+        &&op_fsgnj, &&op_fsgnjn, &&op_fsgnjx, &&op_feq, &&op_fle, &&op_fcvt_w_s, &&op_fcvt_s_w,
+        &&op_fmv_s_x, &&op_addi, &&op_slli, &&op_srai, &&op_lw, &&op_flw, &&op_jalr, &&op_sw,
+        &&op_fsw, &&op_beq, &&op_bne, &&op_blt, &&op_bge, &&op_lui, &&op_jal, &&leave_midway,
+        &&op_inb, &&op_outb,
+        &&leave_midway, // InstType::sentinel
+        &&fall_through,
+    };
+
+    const uint32_t text_len = dinsts.size();
+    if (block_cache.block_at.size() != text_len)
+        block_cache.build(dinsts);
+
+    Block *b = nullptr;
+    const ThreadedInst *ip = nullptr, *block_ip = nullptr;
+    uint32_t pc = this->pc, prev_pc = this->prev_pc; // pc is the address of the current block
+    uint32_t partial = 0; // retired instructions of a block left midway
+    uint64_t steps = 0; // instructions left to step_exec
+    uint64_t budget = clocks < max_clocks ? max_clocks - clocks : 0;
+    uint32_t r[REG_LEN];
+    float f[REG_LEN];
+    copy(this->r, this->r + REG_LEN, r);
+    copy(this->f, this->f + REG_LEN, f);
+    uint32_t *const mem = this->mem.data();
+    const uint32_t mem_size = this->mem_size;
+    const bool show_max = show_max_f;
+    bool res = true;
+
+    fesetround(FE_TONEAREST);
+
+#define CUR_PC() (pc + (uint32_t)(ip - block_ip) * WORD_SIZE)
+
+#define UPDATE_MAX() do { \
+        if (show_max) \
+            for (uint32_t i = 0; i < REG_LEN; i++) \
+                r_max[i] = max(r_max[i], r[i]); \
+    } while (0)
+
+#define NEXT() do { \
+        UPDATE_MAX(); \
+        ip++; \
+        goto *ip->handler; \
+    } while (0)
+
+#define JUMP(target) do { \
+        UPDATE_MAX(); \
+        uint32_t next_pc = (target); \
+        prev_pc = CUR_PC(); \
+        pc = next_pc; \
+        goto enter_block; \
+    } while (0)
+
+#define F_RESULT(rd, expr) do { \
+        float v = (expr); \
+        if (isnan(v)) \
+            goto leave_midway; \
+        f[rd] = v; \
+        NEXT(); \
+    } while (0)
+
+enter_block:
+    if ((pc >> 2) >= text_len)
+        goto out_of_range;
+    b = &block_cache.blocks[block_cache.block_of(dinsts, pc >> 2, handlers)];
+    if (b->len > budget)
+        goto out_of_budget;
+    budget -= b->len;
+    b->count++;
+    block_ip = ip = block_cache.code.data() + b->code;
+    goto *ip->handler;
+
+    // R type
+op_add:
+    r[ip->rd] = r[ip->rs1] + r[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_sub:
+    r[ip->rd] = r[ip->rs1] - r[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_or_:
+    r[ip->rd] = r[ip->rs1] | r[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_fadd:
+    F_RESULT(ip->rd, f[ip->rs1] + f[ip->rs2]);
+op_fsub:
+    F_RESULT(ip->rd, f[ip->rs1] - f[ip->rs2]);
+op_fmul:
+    F_RESULT(ip->rd, f[ip->rs1] * f[ip->rs2]);
+op_fsqrt:
+    F_RESULT(ip->rd, sqrtf(f[ip->rs1]));
+op_fdiv:
+    F_RESULT(ip->rd, f[ip->rs1] / f[ip->rs2]);
+op_fsgnj:
+    F_RESULT(ip->rd, bits_to_float((float_to_bits(f[ip->rs1]) & 0x7fffffff) | (float_to_bits(f[ip->rs2]) & 0x80000000)));
+op_fsgnjn:
+    F_RESULT(ip->rd, bits_to_float((float_to_bits(f[ip->rs1]) & 0x7fffffff) | (~float_to_bits(f[ip->rs2]) & 0x80000000)));
+op_fsgnjx:
+    F_RESULT(ip->rd, bits_to_float(float_to_bits(f[ip->rs1]) ^ (float_to_bits(f[ip->rs2]) & 0x80000000)));
+op_feq:
+    r[ip->rd] = f[ip->rs1] == f[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_fle:
+    r[ip->rd] = f[ip->rs1] <= f[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_fcvt_w_s:
+    r[ip->rd] = (uint32_t)((int32_t)nearbyintf(f[ip->rs1]));
+    r[0] = 0;
+    NEXT();
+op_fcvt_s_w:
+    f[ip->rd] = (int32_t)r[ip->rs1];
+    NEXT();
+op_fmv_s_x:
+    F_RESULT(ip->rd, bits_to_float(r[ip->rs1]));
+    // I type
+op_addi:
+    r[ip->rd] = r[ip->rs1] + ip->imm;
+    r[0] = 0;
+    NEXT();
+op_slli:
+    r[ip->rd] = r[ip->rs1] << ip->imm;
+    r[0] = 0;
+    NEXT();
+op_srai:
+    r[ip->rd] = (uint32_t)((int32_t)r[ip->rs1] >> ip->imm);
+    r[0] = 0;
+    NEXT();
+op_lw:
+    {
+        uint32_t idx = (r[ip->rs1] + ip->imm) >> 2;
+        if (!(idx < mem_size))
+            goto leave_midway;
+        r[ip->rd] = mem[idx];
+        r[0] = 0;
+    }
+    NEXT();
+op_flw:
+    {
+        uint32_t idx = (r[ip->rs1] + ip->imm) >> 2;
+        if (!(idx < mem_size))
+            goto leave_midway;
+        F_RESULT(ip->rd, bits_to_float(mem[idx]));
+    }
+op_jalr:
+    r[ip->rd] = CUR_PC() + WORD_SIZE;
+    r[0] = 0;
+    JUMP(r[ip->rs1] + ip->imm);
+    // S type
+op_sw:
+    {
+        uint32_t idx = (r[ip->rs1] + ip->imm) >> 2;
+        if (!(idx < mem_size))
+            goto leave_midway;
+        mem[idx] = r[ip->rs2];
+    }
+    NEXT();
+op_fsw:
+    {
+        uint32_t idx = (r[ip->rs1] + ip->imm) >> 2;
+        if (!(idx < mem_size))
+            goto leave_midway;
+        mem[idx] = float_to_bits(f[ip->rs2]);
+    }
+    NEXT();
+    // SB type
+op_beq:
+    JUMP(CUR_PC() + (r[ip->rs1] == r[ip->rs2] ? ip->imm : WORD_SIZE));
+op_bne:
+    JUMP(CUR_PC() + (r[ip->rs1] != r[ip->rs2] ? ip->imm : WORD_SIZE));
+op_blt:
+    JUMP(CUR_PC() + ((int32_t)r[ip->rs1] < (int32_t)r[ip->rs2] ? ip->imm : WORD_SIZE));
+op_bge:
+    JUMP(CUR_PC() + ((int32_t)r[ip->rs1] >= (int32_t)r[ip->rs2] ? ip->imm : WORD_SIZE));
+    // U type
+op_lui:
+    r[ip->rd] = (uint32_t)ip->imm | (r[ip->rd] & 0x00000fff); // preserve the lowest 12 bits
+    r[0] = 0;
+    NEXT();
+    // UJ type
+op_jal:
+    r[ip->rd] = CUR_PC() + WORD_SIZE;
+    r[0] = 0;
+    JUMP(CUR_PC() + ip->imm);
+    // original
+op_inb:
+    r[ip->rd] = io->get(); // clears upper 24 bits
+    r[0] = 0;
+    NEXT();
+op_outb:
+    io->put((char)r[ip->rs1]);
+    if (exception_f) { // the output differs from the expected one; stop after this outb
+        UPDATE_MAX();
+        ip++;
+        goto leave_after;
+    }
+    NEXT();
+
+fall_through:
+    prev_pc = CUR_PC() - WORD_SIZE;
+    pc = CUR_PC();
+    goto enter_block;
+
+leave_midway: // halt, exception or invalid instruction at ip
+    b->count--;
+    partial = ip - block_ip;
+    pc = CUR_PC();
+    if (partial > 0)
+        prev_pc = pc - WORD_SIZE;
+    steps = 1;
+    goto leave;
+
+leave_after: // stopped after the instruction in front of ip
+    b->count--;
+    partial = ip - block_ip;
+    pc = CUR_PC();
+    prev_pc = pc - WORD_SIZE;
+    goto leave;
+
+out_of_budget: // max_clocks is reached inside this block
+    steps = budget;
+    goto leave;
+
+out_of_range:
+    print_line(prev_pc);
+    log() << "PC is out of range." << endl << endl;
+    res = false;
+    goto leave;
+
+leave:
+    this->pc = pc;
+    this->prev_pc = prev_pc;
+    copy(r, r + REG_LEN, this->r);
+    copy(f, f + REG_LEN, this->f);
+    if (partial > 0) {
+        for (uint32_t i = b->start; i < b->start + partial; i++) {
+            exec_count[i]++;
+        }
+        clocks += partial;
+    }
+    flush_block_counters(dinsts);
+
+    for (; steps > 0 && res && !halted_f && !exception_f; steps--)
+        res = step_exec(this, dinsts);
+
+    return res;
+
+#undef CUR_PC
+#undef UPDATE_MAX
+#undef NEXT
+#undef JUMP
+#undef F_RESULT
+}
+
+void CPU::flush_block_counters(const vector<DecodedInst> &dinsts)
+{
+    for (Block &b : block_cache.blocks) {
+        if (b.count == 0)
+            continue;
+        for (uint32_t i = b.start; i < b.start + b.len; i++) {
+            exec_count[i] += b.count;
+        }
+        clocks += b.count * b.len;
+        b.count = 0;
+    }
+}
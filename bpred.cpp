@@ -0,0 +1,196 @@
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+#include "common.h"
+
+const uint32_t BPRED_MAX_BITS = 24;
+
+// backward taken, forward not taken
+class StaticBTFN : public BranchPredictor
+{
+public:
+    bool predict(uint32_t pc, int32_t offset) override { return offset < 0; }
+    void update(uint32_t pc, bool is_taken) override {}
+};
+
+// last outcome per table entry
+class OneBit : public BranchPredictor
+{
+public:
+    OneBit(uint32_t bits) : mask((1u << bits) - 1), table(1u << bits, false) {}
+    bool predict(uint32_t pc, int32_t offset) override { return table[(pc >> 2) & mask]; }
+    void update(uint32_t pc, bool is_taken) override { table[(pc >> 2) & mask] = is_taken; }
+
+private:
+    uint32_t mask;
+    vector<bool> table;
+};
+
+// saturating counters indexed by pc xor the last history_bits outcomes
+// (gshare), or by pc alone with no history
+class TwoBit : public BranchPredictor
+{
+public:
+    TwoBit(uint32_t bits, uint32_t history_bits)
+        : mask((1u << bits) - 1), history_mask((1u << history_bits) - 1), history(0), table(1u << bits, 1) {}
+    bool predict(uint32_t pc, int32_t offset) override { return table[index(pc)] >= 2; }
+    void update(uint32_t pc, bool is_taken) override
+    {
+        uint8_t &c = table[index(pc)];
+        if (is_taken && c < 3)
+            c++;
+        else if (!is_taken && c > 0)
+            c--;
+        history = ((history << 1) | is_taken) & history_mask;
+    }
+
+private:
+    uint32_t mask, history_mask;
+    uint32_t history;
+    vector<uint8_t> table; // 0, 1: not taken; 2, 3: taken
+
+    uint32_t index(uint32_t pc) { return ((pc >> 2) ^ history) & mask; }
+};
+
+static bool parse_bits(const string &s, uint32_t &bits)
+{
+    try {
+        size_t pos;
+        bits = stoul(s, &pos);
+        return pos == s.size() && bits <= BPRED_MAX_BITS;
+    } catch (logic_error &) { // stoul
+        return false;
+    }
+}
+
+static BranchPredictor *make_predictor(const string &spec)
+{
+    vector<string> fields = split_string(spec, ":");
+    if (fields.size() == 1 && fields[0] == "btfn")
+        return new StaticBTFN();
+    bool is_gshare = !fields.empty() && fields[0] == "gshare";
+    if (fields.size() != 2 && !(is_gshare && fields.size() == 3))
+        return nullptr;
+
+    uint32_t bits;
+    if (!parse_bits(fields[1], bits) || bits == 0)
+        return nullptr;
+    uint32_t history_bits = bits; // the history covers the whole index by default
+    if (fields.size() == 3 && (!parse_bits(fields[2], history_bits) || history_bits > bits))
+        return nullptr;
+    if (fields[0] == "1bit")
+        return new OneBit(bits);
+    if (fields[0] == "2bit")
+        return new TwoBit(bits, 0);
+    if (is_gshare)
+        return new TwoBit(bits, history_bits);
+    return nullptr;
+}
+
+BranchSim::BranchSim(Simulator *sim, size_t worst_sites)
+    : sim(sim), text_len(sim->insts().size()), worst_sites(worst_sites)
+{
+}
+
+BranchSim::~BranchSim()
+{
+    for (BranchPredictor *p : predictors)
+        delete p;
+}
+
+bool BranchSim::add_predictors(const string &specs, string &error)
+{
+    for (const string &spec : split_string(specs, ",")) {
+        BranchPredictor *p = make_predictor(spec);
+        if (!p) {
+            error = "invalid branch predictor: " + spec;
+            return false;
+        }
+        names.push_back(spec);
+        predictors.push_back(p);
+        misses.push_back(vector<uint64_t>(text_len));
+    }
+    if (predictors.empty()) {
+        error = "no branch predictor";
+        return false;
+    }
+    execs.assign(text_len, 0);
+    takens.assign(text_len, 0);
+    return true;
+}
+
+void BranchSim::retire(const RetireEvent &e)
+{
+    InstType t = e.inst->type;
+    if (t != InstType::beq && t != InstType::bne && t != InstType::blt && t != InstType::bge)
+        return;
+
+    uint32_t idx = e.pc >> 2;
+    bool is_taken = e.next_pc != e.pc + WORD_SIZE;
+    execs[idx]++;
+    takens[idx] += is_taken;
+    for (size_t i = 0; i < predictors.size(); i++) {
+        if (predictors[i]->predict(e.pc, e.inst->imm) != is_taken)
+            misses[i][idx]++;
+        predictors[i]->update(e.pc, is_taken);
+    }
+}
+
+static void print_rate(ostream &os, uint64_t n, uint64_t total)
+{
+    os << fixed << setprecision(2) << setfill(' ') << setw(9) << (total ? 100.0 * n / total : 0.0) << "%" << defaultfloat;
+}
+
+void BranchSim::print()
+{
+    ostream &log = sim->log();
+    uint64_t total = 0, total_taken = 0;
+    for (uint32_t i = 0; i < text_len; i++) {
+        total += execs[i];
+        total_taken += takens[i];
+    }
+
+    log << endl << "[Branch prediction]" << endl;
+    log << total << " branches, " << fixed << setprecision(2) << (total ? 100.0 * total_taken / total : 0.0)
+         << "% taken." << defaultfloat << endl << endl;
+
+    log << setfill(' ') << left << setw(16) << "predictor" << right << setw(14) << "mispredicts" << "  mispredict rate" << endl;
+    vector<uint64_t> site_misses(text_len);
+    for (size_t p = 0; p < predictors.size(); p++) {
+        uint64_t n = 0;
+        for (uint32_t i = 0; i < text_len; i++) {
+            n += misses[p][i];
+            site_misses[i] += misses[p][i];
+        }
+        log << setfill(' ') << left << setw(16) << names[p] << right << setw(14) << n << "      ";
+        print_rate(log, n, total);
+        log << endl;
+    }
+
+    // sites ranked by mispredicts summed over the predictors
+    vector<uint32_t> worst;
+    for (uint32_t i = 0; i < text_len; i++) {
+        if (site_misses[i] > 0)
+            worst.push_back(i);
+    }
+    stable_sort(worst.begin(), worst.end(),
+                [&site_misses](uint32_t a, uint32_t b) { return site_misses[a] > site_misses[b]; });
+    if (worst.size() > worst_sites)
+        worst.resize(worst_sites);
+
+    log << endl << "Worst branches (execs, taken, mispredict rate per predictor):" << endl;
+    for (uint32_t i : worst) {
+        log << setw(14) << setfill(' ') << execs[i];
+        print_rate(log, takens[i], execs[i]);
+        for (size_t p = 0; p < predictors.size(); p++)
+            print_rate(log, misses[p][i], execs[i]);
+        log << "  ";
+        sim->print_line(i << 2);
+    }
+}
@@ -0,0 +1,222 @@
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+
+using namespace std;
+
+#include "common.h"
+
+const int CACHE_MISS_LABELS = 10;
+
+static bool parse_size(const string &s, uint32_t &size)
+{
+    if (s.empty())
+        return false;
+    uint32_t unit = 1;
+    string digits = s;
+    if (s.back() == 'K' || s.back() == 'k')
+        unit = 1024;
+    else if (s.back() == 'M' || s.back() == 'm')
+        unit = 1024 * 1024;
+    if (unit != 1)
+        digits.pop_back();
+    try {
+        size_t pos;
+        unsigned long n = stoul(digits, &pos);
+        if (pos != digits.size() || n == 0 || n > UINT32_MAX / unit)
+            return false;
+        size = n * unit;
+    } catch (logic_error &) { // stoul
+        return false;
+    }
+    return true;
+}
+
+static bool is_pow2(uint32_t n)
+{
+    return n && !(n & (n - 1));
+}
+
+static uint32_t log2_of(uint32_t n)
+{
+    uint32_t b = 0;
+    while ((1u << b) < n)
+        b++;
+    return b;
+}
+
+DataCache::DataCache()
+    : reads(0), writes(0), read_misses(0), write_misses(0), writebacks(0), now(0), rand_state(2463534242u)
+{
+}
+
+bool DataCache::configure(const string &spec)
+{
+    this->spec = spec;
+    vector<string> fields = split_string(spec, "/");
+    if (fields.size() < 3 || fields.size() > 5)
+        return false;
+
+    uint32_t size, line, n_ways;
+    if (!parse_size(fields[0], size) || !parse_size(fields[1], line) || !parse_size(fields[2], n_ways))
+        return false;
+    if (!is_pow2(size) || !is_pow2(line) || line < WORD_SIZE || size % (line * n_ways) != 0)
+        return false;
+    uint32_t sets = size / (line * n_ways);
+    if (!is_pow2(sets))
+        return false;
+
+    is_write_back = true;
+    replace = Replace::lru;
+    for (size_t i = 3; i < fields.size(); i++) {
+        if (fields[i] == "wb")
+            is_write_back = true;
+        else if (fields[i] == "wt")
+            is_write_back = false;
+        else if (fields[i] == "lru")
+            replace = Replace::lru;
+        else if (fields[i] == "fifo")
+            replace = Replace::fifo;
+        else if (fields[i] == "random")
+            replace = Replace::random;
+        else
+            return false;
+    }
+
+    line_bits = log2_of(line);
+    set_bits = log2_of(sets);
+    ways = n_ways;
+    tags.assign(sets * ways, 0);
+    stamps.assign(sets * ways, 0);
+    dirty.assign(sets * ways, false);
+    return true;
+}
+
+void DataCache::access(uint32_t addr, bool is_write, uint32_t idx)
+{
+    now++;
+    if (is_write)
+        writes++;
+    else
+        reads++;
+
+    uint32_t block = addr >> line_bits;
+    uint32_t set = block & ((1u << set_bits) - 1);
+    uint32_t tag = block >> set_bits;
+    uint32_t base = set * ways;
+
+    for (uint32_t w = base; w < base + ways; w++) {
+        if (stamps[w] && tags[w] == tag) {
+            if (replace == Replace::lru)
+                stamps[w] = now;
+            if (is_write && is_write_back)
+                dirty[w] = true;
+            return;
+        }
+    }
+
+    if (is_write)
+        write_misses++;
+    else
+        read_misses++;
+    misses_at[idx]++;
+    if (is_write && !is_write_back) // no write allocate
+        return;
+
+    // fill an invalid way, else evict
+    uint32_t victim = base + ways;
+    for (uint32_t w = base; w < base + ways; w++) {
+        if (!stamps[w]) {
+            victim = w;
+            break;
+        }
+    }
+    if (victim == base + ways) {
+        if (replace == Replace::random) {
+            rand_state ^= rand_state << 13;
+            rand_state ^= rand_state >> 17;
+            rand_state ^= rand_state << 5;
+            victim = base + rand_state % ways;
+        } else { // oldest use or fill
+            victim = base;
+            for (uint32_t w = base + 1; w < base + ways; w++) {
+                if (stamps[w] < stamps[victim])
+                    victim = w;
+            }
+        }
+    }
+    if (stamps[victim] && dirty[victim])
+        writebacks++;
+    tags[victim] = tag;
+    stamps[victim] = now;
+    dirty[victim] = is_write;
+}
+
+void DataCache::print_stat(ostream &os, uint64_t miss_penalty)
+{
+    uint64_t accesses = reads + writes, misses = read_misses + write_misses;
+    os << setfill(' ') << left << setw(24) << spec << right
+         << setw(14) << accesses << setw(14) << misses << "  "
+         << fixed << setprecision(2) << setw(8) << (accesses ? 100.0 * misses / accesses : 0.0) << "%" << defaultfloat
+         << setw(12) << read_misses << setw(12) << write_misses << setw(12) << writebacks
+         << setw(16) << misses * miss_penalty << endl;
+}
+
+CacheSim::CacheSim(Simulator *sim, uint64_t miss_penalty)
+    : sim(sim), text_len(sim->insts().size()), miss_penalty(miss_penalty)
+{
+}
+
+bool CacheSim::add_configs(const string &specs, string &error)
+{
+    for (const string &spec : split_string(specs, ",")) {
+        DataCache cache;
+        if (!cache.configure(spec)) {
+            error = "invalid cache config: " + spec;
+            return false;
+        }
+        cache.get_misses_at().assign(text_len, 0);
+        caches.push_back(cache);
+    }
+    if (caches.empty()) {
+        error = "no cache config";
+        return false;
+    }
+    return true;
+}
+
+void CacheSim::retire(const RetireEvent &e)
+{
+    InstType t = e.inst->type;
+    if (t != InstType::lw && t != InstType::flw && t != InstType::sw && t != InstType::fsw)
+        return;
+    if (e.next_pc == e.pc) // out of range, nothing accessed
+        return;
+
+    bool is_write = t == InstType::sw || t == InstType::fsw;
+    for (DataCache &cache : caches)
+        cache.access(e.mem_addr, is_write, e.pc >> 2);
+}
+
+void CacheSim::print()
+{
+    ostream &log = sim->log();
+    log << endl << "[Data cache]" << endl;
+    log << "Miss penalty: " << miss_penalty << " cycles." << endl << endl;
+
+    log << setfill(' ') << left << setw(24) << "config" << right
+         << setw(14) << "accesses" << setw(14) << "misses" << "  miss rate"
+         << setw(12) << "read miss" << setw(12) << "write miss" << setw(12) << "writebacks"
+         << setw(16) << "cycles lost" << endl;
+    for (DataCache &cache : caches)
+        cache.print_stat(log, miss_penalty);
+
+    for (DataCache &cache : caches) {
+        log << endl << "Misses per label (" << cache.get_spec() << "):" << endl;
+        vector<pair<uint64_t, string>> by_label = sum_by_label(sim, cache.get_misses_at());
+        for (int i = 0; i < CACHE_MISS_LABELS && i < (int)by_label.size() && by_label[i].first > 0; i++)
+            log << setw(14) << setfill(' ') << by_label[i].first << "  " << by_label[i].second << endl;
+    }
+}
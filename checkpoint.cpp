@@ -0,0 +1,183 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "common.h"
+
+// layout: CheckpointHeader, r[32], f[32], r_max[32], exec_count[text_len],
+// page numbers[n_pages], padding to a page boundary, page contents
+struct CheckpointHeader
+{
+    char magic[4];
+    uint32_t text_len, mem_size, page_size;
+    uint64_t text_hash;
+    uint32_t pc, prev_pc;
+    uint64_t clocks, in_pos;
+    uint32_t n_pages, reserved;
+};
+
+static const char CHECKPOINT_MAGIC[4] = {'Z', 'C', 'K', '1'};
+
+// FNV-1a over the decoded program, so a checkpoint is not restored into
+// another one
+static uint64_t hash_text(const vector<DecodedInst> &dinsts)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (const DecodedInst &inst : dinsts) {
+        uint32_t words[2] = {(uint32_t)inst.type | inst.rd << 8 | inst.rs1 << 16 | inst.rs2 << 24, (uint32_t)inst.imm};
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(words);
+        for (size_t i = 0; i < sizeof(words); i++)
+            h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = static_cast<const char *>(buf);
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+    char *p = static_cast<char *>(buf);
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// written next to the file and renamed over it, so a checkpoint the guest
+// memory is still mapped from is never truncated under it
+bool CPU::save_checkpoint(const string &name, const vector<DecodedInst> &dinsts)
+{
+    string tmp_name = name + ".tmp";
+    int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    vector<uint32_t> pages = mem.used_pages();
+    const size_t page = GuestMemory::page_size();
+
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.text_len = exec_count.size();
+    h.mem_size = mem_size;
+    h.page_size = page;
+    h.text_hash = hash_text(dinsts);
+    h.pc = pc;
+    h.prev_pc = prev_pc;
+    h.clocks = clocks;
+    h.in_pos = io->get_in_pos();
+    h.n_pages = pages.size();
+
+    size_t meta = sizeof(h) + sizeof(r) + sizeof(f) + sizeof(r_max) + exec_count.size() * sizeof(uint64_t)
+                  + pages.size() * sizeof(uint32_t);
+    vector<char> padding((page - meta % page) % page, 0);
+    bool ok = write_all(fd, &h, sizeof(h)) && write_all(fd, r, sizeof(r)) && write_all(fd, f, sizeof(f))
+              && write_all(fd, r_max, sizeof(r_max))
+              && write_all(fd, exec_count.data(), exec_count.size() * sizeof(uint64_t))
+              && write_all(fd, pages.data(), pages.size() * sizeof(uint32_t))
+              && write_all(fd, padding.data(), padding.size());
+    const char *b = reinterpret_cast<const char *>(mem.data());
+    size_t bytes = (size_t)mem_size * sizeof(uint32_t);
+    for (size_t i = 0; ok && i < pages.size(); i++) {
+        size_t start = (size_t)pages[i] * page;
+        size_t n = min(page, bytes - start);
+        vector<char> tail(page - n, 0); // the last page may be partial
+        ok = write_all(fd, b + start, n) && write_all(fd, tail.data(), tail.size());
+    }
+    ok = ::close(fd) == 0 && ok && rename(tmp_name.c_str(), name.c_str()) == 0;
+    if (!ok)
+        unlink(tmp_name.c_str());
+    return ok;
+}
+
+// the CPU is left untouched if the file is rejected
+bool CPU::restore_checkpoint(const string &name, const vector<DecodedInst> &dinsts, string &error)
+{
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = "cannot open checkpoint";
+        return false;
+    }
+
+    CheckpointHeader h;
+    if (!read_all(fd, &h, sizeof(h)) || memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0) {
+        error = "invalid checkpoint";
+        ::close(fd);
+        return false;
+    }
+    const size_t page = GuestMemory::page_size();
+    if (h.text_len != exec_count.size() || h.text_hash != hash_text(dinsts) || h.mem_size != mem_size) {
+        error = "checkpoint is of another program";
+        ::close(fd);
+        return false;
+    }
+    if (h.page_size != page) {
+        error = "checkpoint is of another page size";
+        ::close(fd);
+        return false;
+    }
+
+    vector<uint32_t> pages(h.n_pages);
+    uint32_t new_r[REG_LEN], new_r_max[REG_LEN];
+    float new_f[REG_LEN];
+    vector<uint64_t> new_exec_count(h.text_len);
+    bool ok = read_all(fd, new_r, sizeof(new_r)) && read_all(fd, new_f, sizeof(new_f))
+              && read_all(fd, new_r_max, sizeof(new_r_max))
+              && read_all(fd, new_exec_count.data(), new_exec_count.size() * sizeof(uint64_t))
+              && read_all(fd, pages.data(), pages.size() * sizeof(uint32_t));
+    size_t meta = sizeof(h) + sizeof(r) + sizeof(f) + sizeof(r_max) + new_exec_count.size() * sizeof(uint64_t)
+                  + pages.size() * sizeof(uint32_t);
+    off_t data_offset = (meta + page - 1) / page * page;
+    struct stat st;
+    if (ok)
+        ok = fstat(fd, &st) == 0 && (uint64_t)st.st_size >= data_offset + (uint64_t)h.n_pages * page;
+    for (size_t i = 0; ok && i < pages.size(); i++)
+        ok = (uint64_t)pages[i] * page < (uint64_t)mem_size * sizeof(uint32_t) && (i == 0 || pages[i] > pages[i - 1]);
+    if (!ok) {
+        error = "checkpoint is truncated";
+        ::close(fd);
+        return false;
+    }
+
+    if (!mem.map_pages(fd, data_offset, pages)) {
+        error = "cannot map checkpoint";
+        ::close(fd);
+        return false;
+    }
+    ::close(fd); // the mapping stays
+
+    copy(new_r, new_r + REG_LEN, r);
+    copy(new_f, new_f + REG_LEN, f);
+    copy(new_r_max, new_r_max + REG_LEN, r_max);
+    copy(new_exec_count.begin(), new_exec_count.end(), exec_count.begin());
+    pc = h.pc;
+    prev_pc = h.prev_pc;
+    clocks = h.clocks;
+    io->set_in_pos(h.in_pos);
+    halted_f = false;
+    exception_f = false;
+    return true;
+}
@@ -3,21 +3,30 @@
 
 #include <vector>
 #include <set>
+#include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <functional>
+
+#include <sys/types.h>
 
 using namespace std;
 extern const uint32_t WORD_SIZE;
 
-// debugger.cpp
-void print_prompt();
-void print_line_of_text_addr(uint32_t addr);
-uint32_t text_addr_of_lnum(uint32_t lnum);
-bool process_command(string cmd_line);
-
 // cpu.cpp
 
-enum class InstType
+enum class InstType : uint8_t
 {
     add, sub, or_, fadd, fsub, fmul, fsqrt, fdiv, fsgnj, fsgnjn, fsgnjx,
     feq, fle, fcvt_w_s, fcvt_s_w, fmv_s_x, addi, slli, srai, lw, flw, jalr,
@@ -26,11 +35,175 @@ enum class InstType
 };
 
 const int INST_LEN = static_cast<int>(InstType::sentinel);
+string inst_type_to_string(InstType t);
+
+// features compiled into a run loop (threaded.cpp)
+enum Feature : unsigned
+{
+    FEAT_MAX = 1 << 0, // register maxima for -show-max
+    FEAT_COUNT = 1 << 1, // per-PC execution counts (statistics, coverage, profile)
+    FEAT_NAN = 1 << 2, // stop at NaN results
+    FEAT_HOOK = 1 << 3, // call the attached monitors
+    FEAT_UNDO = 1 << 4, // record what each instruction overwrites (implies FEAT_COUNT)
+    FEAT_BREAK = 1 << 5, // stop in front of breakpoints
+    FEAT_ALL = (1 << 6) - 1
+};
+
+struct DecodedInst;
+class Jit;
+class Simulator;
+class UndoLog;
+
+// instruction record of the direct-threaded interpreter (threaded.cpp)
+struct ThreadedInst
+{
+    const void *handler;
+    uint8_t rd, rs1, rs2;
+    int32_t imm;
+};
+
+// basic block of the text (blocks.cpp)
+struct Block
+{
+    uint32_t start, len; // text indices [start, start + len)
+    uint32_t code; // offset of the translated block in BlockCache::code
+    uint64_t count; // executions not yet folded into the CPU statistics
+};
+
+struct BlockCache
+{
+    vector<Block> blocks;
+    vector<int32_t> block_at; // text index -> block starting there, or -1
+    vector<bool> is_leader;
+    vector<ThreadedInst> code;
+
+    void build(const vector<DecodedInst> &dinsts);
+    int32_t block_of(const vector<DecodedInst> &dinsts, uint32_t idx, const void *const *handlers);
+};
+
+// retired instruction as seen by a Monitor
+struct RetireEvent
+{
+    uint32_t pc, next_pc;
+    const DecodedInst *inst;
+    uint32_t mem_addr; // effective address of lw/flw/sw/fsw
+    const uint32_t *r; // register files after the instruction
+    const float *f;
+};
+
+// observer attached to the CPU, called for every retired instruction
+// (FEAT_HOOK); Simulator::run takes the threaded loop while any is attached
+class Monitor
+{
+public:
+    virtual ~Monitor() {}
+    virtual void retire(const RetireEvent &e) = 0;
+};
+
+// receiver of captured guest output, in chunks of up to OUT_BUF_SIZE bytes,
+// or of every byte as outb writes it (GuestIO::check_output)
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+    virtual void write(const char *buf, size_t len) = 0;
+};
+
+// byte streams of inb/outb (io.cpp)
+class GuestIO
+{
+public:
+    static const size_t OUT_BUF_SIZE = 1 << 20;
+
+    GuestIO();
+    ~GuestIO();
+    GuestIO(const GuestIO &) = delete;
+    GuestIO &operator=(const GuestIO &) = delete;
+
+    bool open_input(const string &name);
+    bool open_output(const string &name); // stdout unless opened
+    // keep the output in memory, or pass it to sink
+    void capture_output(OutputSink *sink = nullptr);
+    // also show each byte to checker when it is written; it may stop the CPU
+    void check_output(OutputSink *checker) { this->checker = checker; }
+    const string &get_captured() { flush(); return captured; }
+    // 0 past the end of the input
+    uint8_t get()
+    {
+        uint8_t c = in_pos < in_buf.size() ? in_buf[in_pos] : 0;
+        in_pos++;
+        return c;
+    }
+    void unget() { in_pos--; }
+    size_t get_in_pos() { return in_pos; }
+    uint64_t get_out_count() { return out_flushed + out_len; } // bytes written so far
+    void set_in_pos(size_t pos) { in_pos = pos; }
+    void put(char c)
+    {
+        if (checker)
+            checker->write(&c, 1);
+        if (out_len == OUT_BUF_SIZE)
+            flush();
+        out_buf[out_len++] = c;
+    }
+    void flush();
+
+private:
+    vector<uint8_t> in_buf;
+    size_t in_pos;
+    int out_fd; // -1 to capture
+    string captured;
+    OutputSink *sink;
+    OutputSink *checker;
+    uint64_t out_flushed;
+    char *out_buf;
+    size_t out_len;
+};
+
+// guest memory (memory.cpp)
+class GuestMemory
+{
+public:
+    // byte range of any (uint32_t)(addr) >> 2 word index
+    static const uint64_t GUARD_RESERVE = 1ull << 32;
+
+    GuestMemory(uint32_t size, bool is_guard = false);
+    ~GuestMemory();
+    GuestMemory(const GuestMemory &) = delete;
+    GuestMemory &operator=(const GuestMemory &) = delete;
+
+    uint32_t *data() { return base; }
+    uint32_t size() { return len; }
+    uint32_t &operator[](uint32_t idx) { return base[idx]; }
+    bool is_guarded() { return reserved > bytes; }
+    bool is_guard_addr(const void *addr);
+    uint64_t resident_pages();
+    uint64_t peak_pages(); // most resident at once since construction or clear()
+    vector<uint32_t> used_pages(); // touched and not all zero
+    bool clear(); // all zero again, and no page resident
+    uint64_t content_hash(); // pages that are not all zero
+    // zero everything, then map pages[i] copy-on-write from fd at offset + i
+    // pages; unchanged on failure. data() moves
+    bool map_pages(int fd, off_t offset, const vector<uint32_t> &pages);
+    static size_t page_size();
+
+private:
+    uint32_t *base;
+    uint32_t len; // in words
+    size_t bytes, reserved;
+    vector<bool> mapped; // per page: copy-on-write from a checkpoint file
+    uint64_t peak; // resident pages before the last map_pages()
+
+    vector<uint32_t> touched_pages();
+};
 
 class CPU
 {
 public:
-    CPU(uint32_t mem_size, vector<uint32_t> static_data);
+    typedef bool (CPU::*RunLoop)(const vector<DecodedInst> &dinsts, uint64_t max_clocks);
+
+    CPU(Simulator *sim, uint32_t mem_size, const uint32_t *static_data, uint32_t data_len, uint32_t text_len,
+        GuestIO *io, bool is_guard_mem = false);
     ~CPU();
 
     uint32_t get_pc() { return pc; }
@@ -41,12 +214,44 @@ public:
     uint64_t get_clocks() { return clocks; }
     bool is_halted() { return halted_f; }
     bool is_exception() { return exception_f; }
+    uint64_t get_exec_count(uint32_t idx) { return exec_count[idx]; }
+    GuestIO *get_io() { return io; }
+    bool is_show_max() { return show_max_f; }
+
+    // for undoing retired instructions
+    void set_r(uint32_t ri, uint32_t value);
+    void set_f_bits(uint32_t ri, uint32_t bits);
+    void set_mem_word(uint32_t idx, uint32_t value);
+    void unretire(uint32_t pc, uint32_t prev_pc); // one clock and one execution back, not halted
+    // back to the start of the program; translated code is kept
+    bool reset(const uint32_t *static_data, uint32_t data_len);
+    uint64_t state_hash(); // pc, registers and memory
 
     void print_state();
-    void print_inst_stat(bool is_sort);
+    void print_inst_stat(const vector<DecodedInst> &dinsts, bool is_sort);
     void print_max();
+    void print_mem_stat();
+    // diagnostics go to the log of the owning Simulator
+    ostream &log();
+    void print_line(uint32_t addr);
 
     void inc_clocks() { clocks++; }
+    void count_exec(uint32_t idx) { exec_count[idx]++; }
+    void add_monitor(Monitor *m) { monitors.push_back(m); }
+    bool has_monitors() { return !monitors.empty(); }
+    void notify_retire(const RetireEvent &e)
+    {
+        for (Monitor *m : monitors)
+            m->retire(e);
+    }
+    void notify_step(uint32_t from, const DecodedInst *inst, uint32_t mem_addr)
+    {
+        notify_retire({from, pc, inst, mem_addr, r, f});
+    }
+    void set_undo_log(UndoLog *log) { undo_log = log; }
+    UndoLog *get_undo_log() { return undo_log; }
+    void record_undo(); // before the instruction at pc runs
+    void raise_exception() { exception_f = true; } // from a monitor; stops after the instruction
     void update_max();
 
     // R type
@@ -90,45 +295,612 @@ public:
     void inb(uint32_t rd);
     void outb(uint32_t rs1);
 
+    // threaded.cpp
+    // runs until halt, an exception or max_clocks; false if interrupted by
+    // an invalid instruction or PC
+    template <unsigned features>
+    bool run_threaded(const vector<DecodedInst> &dinsts, uint64_t max_clocks = UINT64_MAX);
+    static RunLoop threaded_loop(unsigned features);
+    // blocks.cpp
+    // same contract as run_threaded, with block-granular accounting; no
+    // monitors or undo log (the threaded loop serves those)
+    bool run_blocks(const vector<DecodedInst> &dinsts, uint64_t max_clocks = UINT64_MAX);
+    // jit.cpp
+    // same contract as run_threaded; compiles blocks to host code on x86-64;
+    // no monitors or undo log either
+    bool run_jit(const vector<DecodedInst> &dinsts, uint64_t max_clocks = UINT64_MAX);
+    // checkpoint.cpp
+    bool save_checkpoint(const string &name, const vector<DecodedInst> &dinsts);
+    bool restore_checkpoint(const string &name, const vector<DecodedInst> &dinsts, string &error);
+
 private:
     static const uint32_t REG_LEN = 32;
     uint32_t pc, prev_pc, r[REG_LEN], r_max[REG_LEN];
     float f[REG_LEN];
-    vector<uint32_t> mem;
+    Simulator *sim;
+    GuestMemory mem;
+    GuestIO *io;
     uint32_t mem_size;
-    bool halted_f, exception_f;
+    bool halted_f, exception_f, show_max_f;
     uint64_t clocks;
-    uint64_t inst_stat[INST_LEN];
+    vector<uint64_t> exec_count; // per text index, including faulting and invalid instructions
+    vector<Monitor *> monitors;
+    UndoLog *undo_log;
+    vector<ThreadedInst> threaded_code;
+    const void *const *threaded_handlers;
+    BlockCache block_cache;
+    Jit *jit;
 
     void report_NaN_exception(uint32_t rd);
     void update_pc(uint32_t new_pc);
     void inc_pc() { update_pc(pc + WORD_SIZE); }
     void flush_r0() { r[0] = 0; }
+    void flush_block_counters(const vector<DecodedInst> &dinsts);
+    void flush_jit_counters(const vector<DecodedInst> &dinsts);
+    void release_jit();
 };
 
 // exec.cpp
-bool step_exec(CPU *cpu, const vector<uint32_t> &insts);
+
+// instruction word decoded once at load time
+struct DecodedInst
+{
+    InstType type; // InstType::sentinel if the encoding is invalid
+    uint8_t rd, rs1, rs2;
+    int32_t imm; // sign-extended immediate, shamt or upper immediate
+};
+
+enum class RegKind : uint8_t { none, x, f };
+
+// register files read and written by each instruction type
+struct Operands
+{
+    RegKind rd, rs1, rs2;
+};
+
+DecodedInst decode_inst(uint32_t word);
+Operands operands_of(InstType t);
+vector<DecodedInst> decode_insts(const uint32_t *insts, uint32_t len);
+bool step_exec(CPU *cpu, const vector<DecodedInst> &dinsts);
+
+// blocks.cpp
+bool is_block_end(InstType type);
+vector<bool> find_leaders(const vector<DecodedInst> &dinsts);
+
+// profile.cpp
+void show_profile(Simulator *sim);
+vector<pair<uint64_t, string>> sum_by_label(Simulator *sim, const vector<uint64_t> &count_at);
+
+// call graph from a shadow stack: calls are jal/jalr with rd = ra,
+// returns are jalr x0, ra, 0; functions are named by the label at the target
+class CallGraph : public Monitor
+{
+public:
+    CallGraph(Simulator *sim);
+    void retire(const RetireEvent &e) override;
+    void print();
+    bool write_collapsed(const string &name); // one "f;g;h clocks" line per stack
+
+private:
+    struct Node
+    {
+        uint32_t func, parent;
+        uint64_t self;
+    };
+    struct Frame
+    {
+        uint32_t node;
+        uint64_t entry_clock;
+    };
+
+    Simulator *sim;
+    uint64_t clocks;
+    vector<string> func_names;
+    vector<uint32_t> func_at; // per text index, -1 until first called
+    vector<uint64_t> calls, inclusive, exclusive;
+    vector<uint32_t> active; // activations on the stack, so recursion is counted once
+    map<pair<uint32_t, uint32_t>, uint64_t> edges; // (caller, callee) -> calls
+    vector<Node> nodes; // node 0 is the root
+    unordered_map<uint64_t, uint32_t> children; // parent << 32 | func -> node
+    vector<Frame> stack;
+
+    uint32_t func_of(uint32_t addr);
+    void push(uint32_t func);
+    void pop();
+    void unwind();
+};
+
+// cache.cpp
+
+// one data cache configuration, "SIZE/LINE/WAYS[/wb|wt][/lru|fifo|random]";
+// write-back caches allocate on write misses, write-through ones do not
+class DataCache
+{
+public:
+    enum class Replace { lru, fifo, random };
+
+    DataCache();
+    bool configure(const string &spec);
+    string get_spec() { return spec; }
+    void access(uint32_t addr, bool is_write, uint32_t idx);
+    void print_stat(ostream &os, uint64_t miss_penalty);
+    vector<uint64_t> &get_misses_at() { return misses_at; }
+
+    uint64_t reads, writes, read_misses, write_misses, writebacks;
+
+private:
+    string spec;
+    uint32_t line_bits, set_bits, ways;
+    bool is_write_back;
+    Replace replace;
+    vector<uint32_t> tags; // sets * ways
+    vector<uint64_t> stamps; // last use (lru) or fill time (fifo), 0 if invalid
+    vector<bool> dirty;
+    uint64_t now;
+    uint32_t rand_state;
+    vector<uint64_t> misses_at; // per text index
+};
+
+// feeds the addresses of lw/flw/sw/fsw to every configured cache
+class CacheSim : public Monitor
+{
+public:
+    CacheSim(Simulator *sim, uint64_t miss_penalty);
+    bool add_configs(const string &specs, string &error); // comma separated
+    void retire(const RetireEvent &e) override;
+    void print();
+
+private:
+    Simulator *sim;
+    uint32_t text_len;
+    uint64_t miss_penalty;
+    vector<DataCache> caches;
+};
+
+// bpred.cpp
+
+// direction predictor for beq/bne/blt/bge
+class BranchPredictor
+{
+public:
+    virtual ~BranchPredictor() {}
+    virtual bool predict(uint32_t pc, int32_t offset) = 0;
+    virtual void update(uint32_t pc, bool is_taken) = 0;
+};
+
+// runs several predictors side by side, "btfn", "1bit:BITS", "2bit:BITS" or
+// "gshare:BITS[:HIST]" where BITS is log2 of the table size and HIST the
+// global history length, at most BITS (the default)
+class BranchSim : public Monitor
+{
+public:
+    BranchSim(Simulator *sim, size_t worst_sites); // branches listed by mispredicts
+    ~BranchSim();
+    bool add_predictors(const string &specs, string &error); // comma separated
+    void retire(const RetireEvent &e) override;
+    void print();
+
+private:
+    Simulator *sim;
+    uint32_t text_len;
+    size_t worst_sites;
+    vector<string> names;
+    vector<BranchPredictor *> predictors;
+    vector<uint64_t> execs, takens; // per text index
+    vector<vector<uint64_t>> misses; // per predictor, per text index
+};
+
+// trace.cpp
+
+// -trace file: TRACE_MAGIC, then per retired instruction a flags byte
+// (TraceFlag) followed by zigzag LEB128 varints of
+//   pc - (previous pc + 4)                      if TRACE_JUMP
+//   rd (one byte), value - previous value of rd if TRACE_REG or TRACE_FREG
+//   mem_addr - previous mem_addr                if TRACE_MEM
+// all previous values start at 0 (the previous pc at -4)
+const char TRACE_MAGIC[4] = {'Z', 'T', 'R', '1'};
+
+enum TraceFlag : uint8_t
+{
+    TRACE_JUMP = 1 << 0,
+    TRACE_REG = 1 << 1, // x register written
+    TRACE_FREG = 1 << 2, // f register written, value is its bits
+    TRACE_MEM = 1 << 3, // lw/flw/sw/fsw address
+};
+
+struct TraceRecord
+{
+    uint32_t pc, value, mem_addr;
+    uint8_t rd, flags; // TRACE_JUMP is left to the writer
+};
+
+TraceRecord make_trace_record(const RetireEvent &e);
+
+// records go through a lock-free single-producer ring to a writer thread
+// that delta-encodes and writes them; the writer sleeps while the ring stays
+// empty and retire wakes it with the next record
+class TraceWriter : public Monitor
+{
+public:
+    TraceWriter() : ring(RING_LEN), head(0), tail(0), is_done(false), is_waiting(false), cached_tail(0), is_ok(true) {}
+    ~TraceWriter() { close(); }
+    bool open(const string &name);
+    void retire(const RetireEvent &e) override;
+    bool close(); // drains the ring; false on a write error
+
+private:
+    static const uint64_t RING_LEN = 1 << 16; // power of 2
+
+    vector<TraceRecord> ring;
+    atomic<uint64_t> head, tail; // next record to produce / consume
+    atomic<bool> is_done;
+    atomic<bool> is_waiting; // the writer sleeps on wakeup
+    mutex mtx;
+    condition_variable wakeup;
+    uint64_t cached_tail; // producer's view of tail
+    ofstream ofs;
+    thread writer;
+    bool is_ok;
+
+    void write_loop();
+};
+
+// cosim.cpp
+
+// lockstep comparison against a reference trace in the text form of
+// tools/trace2txt, one retired instruction per line:
+//   PC  [xN|fN = VALUE]  [@ADDR]
+// in hex; no register means none (or x0) is written, a missing address is
+// not compared
+class CoSim : public Monitor
+{
+public:
+    CoSim(Simulator *sim)
+        : sim(sim), base(nullptr), size(0), pos(0), released(0), matched(0), is_ended(false), is_mismatched(false),
+          is_invalid(false) {}
+    ~CoSim();
+    bool open(const string &name);
+    void retire(const RetireEvent &e) override;
+    bool is_passed() { return !is_mismatched && !is_invalid; } // no mismatch, and the trace could be read
+    void print();
+
+private:
+    Simulator *sim;
+    const char *base; // the whole file, mapped and read sequentially
+    size_t size, pos;
+    size_t released; // pages before this are dropped
+    uint64_t matched;
+    bool is_ended, is_mismatched, is_invalid;
+
+    bool parse_line(TraceRecord &ref);
+    void report_mismatch(const RetireEvent &e, const TraceRecord &rec, const TraceRecord &ref, const char *what);
+};
+
+// expect.cpp
+
+// compares the outb bytes with a golden output as they are written and stops
+// at the first difference; with a tolerance, the pixel values of a PPM file
+// (P3 numbers, P6 bytes after the header) may differ by up to that much
+class OutputChecker : public OutputSink
+{
+public:
+    OutputChecker(Simulator *sim, uint32_t tolerance);
+    ~OutputChecker();
+    bool open(const string &name);
+    // each byte of outb (GuestIO::check_output); a difference raises an
+    // exception, so the CPU stops right after the outb
+    void write(const char *buf, size_t len) override;
+    // no difference, and the whole file was written; reports a difference
+    bool is_passed();
+    void print();
+
+private:
+    Simulator *sim;
+    uint32_t tolerance;
+    const uint8_t *base; // the golden output, mapped
+    size_t size, pos; // expected bytes consumed
+    size_t header_len; // of a PPM file, compared exactly; 0 otherwise
+    bool is_p3;
+    uint64_t out_len; // bytes written
+    bool is_in_number; // inside a P3 value, kept in number
+    uint64_t number_start; // its output offset
+    uint32_t number;
+    bool is_mismatched, is_reported;
+    bool is_at_outb; // false when the output ended early
+    uint64_t mismatch_offset;
+    string mismatch_expected, mismatch_actual;
+
+    bool compare_number(); // the P3 value just ended against the next expected one
+    void set_mismatch(uint64_t offset, const string &expected, const string &actual);
+    void report();
+};
+
+// watchdog.cpp
+
+// detects a program looping forever: a hash of the whole state is sampled
+// every so many clocks, and a state seen again with no inb/outb in between
+// is a hang; the period doubles while hashing would cost more than 1% of
+// the run time
+class Watchdog
+{
+public:
+    static const uint64_t DEFAULT_PERIOD = 1 << 24;
+
+    // the threaded engine must count executions (Options::is_count)
+    Watchdog(Simulator *sim, uint64_t period = DEFAULT_PERIOD);
+    uint64_t next_sample() { return next; } // clock to stop the engine at
+    bool sample(); // true if hanging
+    void report(); // the looping lines, those executed since the last sample
+
+private:
+    Simulator *sim;
+    uint64_t period, next;
+    uint64_t in_pos, out_count; // progress at the last sample
+    unordered_map<uint64_t, uint64_t> seen; // state hash -> clocks, since the last progress
+    vector<uint64_t> last_counts; // exec counts at the last sample
+    uint64_t repeat_from, repeat_at;
+    chrono::steady_clock::time_point last_time;
+};
+
+// Simulator::run within a clock budget and, with is_watchdog, until a hang;
+// such a stop is reported to the log, sets is_stopped and leaves the CPU in
+// an exception. at_checkpoint is called once when the clocks reach
+// checkpoint_at. False if interrupted by an invalid instruction or PC
+bool run_budgeted(Simulator *sim, uint64_t max_clocks, bool is_watchdog, bool &is_stopped,
+                  uint64_t checkpoint_at = UINT64_MAX, const function<void()> &at_checkpoint = nullptr);
+
+// undo.cpp
+
+// bounded log of what each retired instruction overwrote, for stepping
+// back in the debugger; output already written by outb is not taken back.
+// The engines call record() before each instruction (FEAT_UNDO).
+class UndoLog
+{
+public:
+    UndoLog(CPU *cpu, const vector<DecodedInst> &dinsts, size_t capacity);
+    // inlined into every handler of the threaded loop, which is the point
+    __attribute__((always_inline)) void record(uint32_t pc, const uint32_t *r, const float *f, const uint32_t *mem, uint32_t mem_size)
+    {
+        uint32_t idx = pc >> 2;
+        uint32_t where = targets[idx], old = 0;
+        if (where < 32)
+            old = r[where];
+        else if (where < 64)
+            memcpy(&old, &f[where - 32], sizeof(old));
+        else if (where == WHERE_MEM) { // sw/fsw
+            uint32_t word = (r[dinsts[idx].rs1] + dinsts[idx].imm) >> 2;
+            if (word < mem_size) {
+                where |= word;
+                old = mem[word];
+            } else // faults
+                where = SLOT_NONE;
+        } else if ((where & WHERE_INPUT) && (where & ~WHERE_INPUT) < 32) // inb
+            old = r[where & ~WHERE_INPUT];
+        ring[next] = {pc, old, where};
+        if (++next == ring.size())
+            next = 0;
+        if (len < ring.size())
+            len++;
+    }
+    bool step_back(); // false if the log is empty
+    void clear(); // forget the history, e.g. after the state was replaced
+    size_t size() { return len; }
+
+private:
+    static const uint32_t SLOT_NONE = 64;
+    static const uint32_t WHERE_MEM = 1u << 31; // low bits: word index
+    static const uint32_t WHERE_INPUT = 1u << 30; // inb also consumed a byte
+
+    struct Entry
+    {
+        uint32_t pc, old;
+        uint32_t where; // register slot (x0-x31, f0-f31, SLOT_NONE) or WHERE_MEM
+    };
+
+    CPU *cpu;
+    const vector<DecodedInst> &dinsts;
+    vector<uint32_t> targets; // per text index: the slot it writes, or WHERE_MEM for stores
+    vector<Entry> ring;
+    size_t next, len;
+};
+
+// timing.cpp
+
+// in-order pipeline estimate: per-type result latency and issue cycles,
+// data hazards on register results and control penalties
+class TimingModel : public Monitor
+{
+public:
+    enum Stall { load_use, fpu, other_data, multi_cycle, taken_branch, jal, jalr, STALL_LEN };
+
+    static const int SINK = 64; // register slot of discarded results
+
+    TimingModel(Simulator *sim);
+    bool load_config(const string &name, string &error);
+    void retire(const RetireEvent &e) override;
+    void print();
+
+private:
+    Simulator *sim;
+    uint32_t latency[INST_LEN], issue_cycles[INST_LEN];
+    uint32_t penalty[STALL_LEN];
+    uint64_t insts, cycles;
+    uint64_t stalls[STALL_LEN];
+    struct TimedInst
+    {
+        InstType type;
+        uint8_t src[3], dst; // register slots
+        Stall hazard; // what readers of the result wait on
+        Stall control; // penalty class, STALL_LEN if none
+    };
+    vector<TimedInst> timed_insts; // per text index
+
+    uint64_t ready[SINK + 1]; // cycle each result is available, x0-x31 then f0-f31
+    Stall producer[SINK + 1]; // hazard class of the instruction writing each register
+};
+
+// zoi.cpp
+
+// .zoi file mapped read-only; the sections are used in place
+class ZoiImage
+{
+public:
+    ZoiImage() : base(nullptr), size(0) {}
+    ~ZoiImage();
+
+    bool open(const string &name);
+    void close();
+
+    bool has_valid_magic() const; // ZOI! or ZOI?
+    bool has_debug_info() const { return base[3] == '?'; }
+    uint32_t data_len() const { return word_at(4); }
+    uint32_t text_len() const { return word_at(8); }
+    bool is_complete() const; // the sections fit in the file
+    uint64_t content_hash() const; // FNV-1a of the whole file as mapped
+
+    const uint32_t *data() const;
+    const uint32_t *text() const;
+    const uint32_t *inst_lines() const; // ZOI? only, nullptr otherwise
+    const char *source() const; // ZOI? only, nullptr otherwise
+    size_t source_len() const; // 0 without debug info
+
+    // debug info of ZOI?, indexed on first use; no lines or labels for ZOI!
+    string source_line(uint32_t lnum) const; // 1-origin
+    bool find_label(const string &label, uint32_t &lnum) const;
+    const vector<string> &labels() const; // in source order
+
+private:
+    const uint8_t *base;
+    size_t size;
+    mutable once_flag index_once;
+    mutable vector<size_t> line_offsets;
+    mutable unordered_map<string, uint32_t> label_index;
+    mutable vector<string> label_names;
+
+    uint32_t word_at(size_t offset) const;
+    void index_source() const;
+    void build_index() const;
+};
 
 // util.cpp
 vector<string> split_string(const string &str, const string &delims);
 string num_to_bin(uint32_t num, int len = 32);
-void print_hex(uint32_t n);
-void print_dec_2(uint32_t n);
-void print_dec_10(uint32_t n);
+void print_hex(uint32_t n, ostream &os = cerr);
+void print_dec_2(uint32_t n, ostream &os = cerr);
+void print_dec_10(uint32_t n, ostream &os = cerr);
 
 // report.cpp
-void report_error(string message);
-void report_warning(string message);
+void report_error(string message, ostream &os = cerr);
+void report_warning(string message, ostream &os = cerr);
+
+// simulator.cpp
+
+enum class Engine { step, threaded, blocks, jit };
+
+// a mapped and decoded program, never changed after loading; simulators
+// running the same program, like the runs of a batch, share one
+struct Program
+{
+    ZoiImage zoi;
+    vector<DecodedInst> dinsts;
+
+    // nullptr with error set if the file is not a complete zoi image
+    static shared_ptr<const Program> load(const string &zoi_name, string &error);
+    // checks the image opened in zoi and decodes its text; false with error set
+    bool decode(string &error);
+};
+
+// one program with its debug info, guest I/O, CPU and breakpoints; instances
+// share no state, so several can run at once on different threads
+class Simulator
+{
+public:
+    struct Options
+    {
+        uint32_t mem_size; // in words
+        Engine engine;
+        bool is_show_max, is_count, is_nan_check;
+        bool is_guard_mem; // Engine::jit only
+
+        Options()
+            : mem_size(DEFAULT_MEM_SIZE), engine(Engine::threaded), is_show_max(false), is_count(false),
+              is_nan_check(true), is_guard_mem(false) {}
+    };
+
+    static const uint32_t DEFAULT_MEM_SIZE = 0x1000000; // 64 MiB
+
+    Simulator(const Options &options, ostream &log = cerr) : options(options), log_os(log), cpu(nullptr) {}
+    ~Simulator();
+    Simulator(const Simulator &) = delete;
+    Simulator &operator=(const Simulator &) = delete;
+
+    // maps and decodes the program and creates the CPU
+    bool load(const string &zoi_name, string &error);
+    // creates the CPU for a program loaded before
+    bool load(shared_ptr<const Program> program, string &error);
+    // starts the loaded program over with new options, keeping the decoded
+    // and translated code; mem_size and is_guard_mem stay as loaded
+    bool reset(const Options &new_options, string &error);
+
+    const Options &get_options() { return options; }
+    ostream &log() { return log_os; }
+    const ZoiImage &image() { return program->zoi; }
+    const vector<DecodedInst> &insts() { return program->dinsts; }
+    GuestIO &io() { return guest_io; }
+    CPU *get_cpu() { return cpu; }
+
+    // runs the engine until halt, an exception or max_clocks; false if
+    // interrupted by an invalid instruction or PC
+    bool run(uint64_t max_clocks = UINT64_MAX);
+    bool step(); // one instruction with the reference interpreter
+    // same as run, also stopping in front of breakpoints (threaded loop)
+    bool run_to_breakpoint(uint64_t max_clocks = UINT64_MAX);
+    bool save_checkpoint(const string &name) { return cpu->save_checkpoint(name, insts()); }
+    bool restore_checkpoint(const string &name, string &error) { return cpu->restore_checkpoint(name, insts(), error); }
+
+    // debug info; the line lookups need ZOI? and throw out_of_range
+    void print_line(uint32_t addr); // "LNUM: source" or the address
+    uint32_t get_word_of_text_addr(uint32_t addr);
+    uint32_t text_addr_of_lnum(uint32_t lnum);
+    uint32_t lnum_of_label(const string &label);
+
+    void add_breakpoint(uint32_t addr);
+    void delete_breakpoint(uint32_t addr);
+    void delete_all_breakpoints();
+    const set<uint32_t> &get_breakpoints() { return breakpoints; }
+    bool is_breakpoint() { return breakpoints.count(cpu->get_pc()); }
+    const vector<bool> &breakpoint_index() { return is_breakpoint_index; }
+
+private:
+    Options options;
+    ostream &log_os;
+    shared_ptr<const Program> program;
+    GuestIO guest_io;
+    CPU *cpu;
+    set<uint32_t> breakpoints;
+    vector<bool> is_breakpoint_index; // text index -> breakpoint, for the run loop
+
+    unsigned features();
+};
+
+// batch.cpp
+// runs the program on every input of the list on a pool of threads, each
+// run within the budget; the exit status of the process
+int run_batch(const string &list_name, const string &zoi_name, const Simulator::Options &options, unsigned jobs,
+              uint64_t max_clocks, bool is_watchdog);
+
+// server.cpp
+// serves "PROGRAM INPUT [OPTIONS]" jobs on a UNIX socket with a pool of
+// threads, keeping loaded programs by content hash; runs until killed
+int run_server(const string &socket_name, unsigned jobs);
+
+// debugger.cpp
+void print_prompt(Simulator *sim);
+bool process_command(Simulator *sim, UndoLog *undo_log, string cmd_line);
 
 // main.cpp
-extern ifstream in_file;
-extern bool is_show_max;
-extern vector<uint32_t> insts, inst_lines;
-extern vector<string> lines;
-extern CPU *cpu;
-uint32_t lnum_of_label(string label);
-extern vector<bool> is_unreached_index;
-bool step_and_report(bool is_show_halted);
+bool step_and_report(Simulator *sim, bool is_show_halted);
+bool continue_and_report(Simulator *sim, bool is_show_halted, uint64_t max_clocks = UINT64_MAX);
 
 #endif
 
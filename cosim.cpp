@@ -0,0 +1,206 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "common.h"
+
+// consumed parts of the reference trace are dropped in chunks of this size
+const size_t COSIM_RELEASE_SIZE = 64 << 20;
+
+CoSim::~CoSim()
+{
+    if (base)
+        munmap(const_cast<char *>(base), size);
+}
+
+bool CoSim::open(const string &name)
+{
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        base = static_cast<const char *>(p);
+        madvise(p, size, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+    return true;
+}
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '=';
+}
+
+static bool parse_hex(const char *&p, const char *end, uint32_t &value)
+{
+    const char *start = p;
+    value = 0;
+    for (; p < end; p++) {
+        char c = *p;
+        uint32_t d;
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else
+            break;
+        value = value << 4 | d;
+    }
+    return p != start && p - start <= 8;
+}
+
+// next instruction of the reference; false at the end or on a syntax error
+// (ref.flags is then 0xff)
+bool CoSim::parse_line(TraceRecord &ref)
+{
+    const char *const end = base + size;
+    ref.flags = 0;
+    while (pos < size) {
+        const char *p = base + pos;
+        const char *eol = p;
+        while (eol < end && *eol != '\n')
+            eol++;
+        pos = eol - base + (eol < end);
+
+        while (p < eol && is_blank(*p))
+            p++;
+        if (p == eol || *p == '#')
+            continue;
+
+        ref.flags = 0xff;
+        uint8_t compared = 0;
+        if (!parse_hex(p, eol, ref.pc))
+            return false;
+        for (;;) {
+            while (p < eol && is_blank(*p))
+                p++;
+            if (p == eol)
+                break;
+            if (*p == 'x' || *p == 'f') {
+                compared |= *p == 'x' ? TRACE_REG : TRACE_FREG;
+                p++;
+                uint32_t rd = 0;
+                const char *digits = p;
+                for (; p < eol && *p >= '0' && *p <= '9'; p++)
+                    rd = rd * 10 + (*p - '0');
+                if (p == digits || rd >= 32)
+                    return false;
+                ref.rd = rd;
+                while (p < eol && is_blank(*p))
+                    p++;
+                if (!parse_hex(p, eol, ref.value))
+                    return false;
+            } else if (*p == '@') {
+                compared |= TRACE_MEM;
+                p++;
+                if (!parse_hex(p, eol, ref.mem_addr))
+                    return false;
+            } else
+                return false;
+        }
+        ref.flags = compared;
+
+        // drop what is behind us
+        if (pos - released >= COSIM_RELEASE_SIZE) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t upto = pos / page * page;
+            madvise(const_cast<char *>(base) + released, upto - released, MADV_DONTNEED);
+            released = upto;
+        }
+        return true;
+    }
+    return false;
+}
+
+static void print_reg(ostream &os, uint8_t flags, uint32_t rd, uint32_t value)
+{
+    if (flags & (TRACE_REG | TRACE_FREG))
+        os << ((flags & TRACE_FREG) ? 'f' : 'x') << rd << " = " << hex << setw(8) << setfill('0') << value << dec;
+    else
+        os << "no register";
+}
+
+void CoSim::report_mismatch(const RetireEvent &e, const TraceRecord &rec, const TraceRecord &ref, const char *what)
+{
+    ostream &log = sim->log();
+    log << "Co-simulation mismatch after " << matched << " instructions (" << what << "):" << endl;
+    log << "  expected " << hex << setw(8) << setfill('0') << ref.pc << dec << "  ";
+    print_reg(log, ref.flags, ref.rd, ref.value);
+    if (ref.flags & TRACE_MEM)
+        log << "  @" << hex << setw(8) << setfill('0') << ref.mem_addr << dec;
+    log << endl;
+    log << "  actual   " << hex << setw(8) << setfill('0') << rec.pc << dec << "  ";
+    print_reg(log, rec.flags, rec.rd, rec.value);
+    if (rec.flags & TRACE_MEM)
+        log << "  @" << hex << setw(8) << setfill('0') << rec.mem_addr << dec;
+    log << endl << endl;
+    sim->print_line(e.pc);
+    is_mismatched = true;
+    sim->get_cpu()->raise_exception();
+}
+
+void CoSim::retire(const RetireEvent &e)
+{
+    if (is_ended || is_mismatched)
+        return;
+
+    TraceRecord ref;
+    if (!parse_line(ref)) {
+        is_ended = true;
+        if (ref.flags == 0xff) {
+            is_invalid = true;
+            report_error("invalid reference trace", sim->log());
+            sim->get_cpu()->raise_exception();
+        }
+        return;
+    }
+
+    TraceRecord rec = make_trace_record(e);
+    const uint8_t reg_flags = TRACE_REG | TRACE_FREG;
+    if (rec.pc != ref.pc)
+        report_mismatch(e, rec, ref, "pc");
+    else if ((rec.flags & reg_flags) != (ref.flags & reg_flags)
+             || ((rec.flags & reg_flags) && (rec.rd != ref.rd || rec.value != ref.value)))
+        report_mismatch(e, rec, ref, "register");
+    else if ((ref.flags & TRACE_MEM) && (!(rec.flags & TRACE_MEM) || rec.mem_addr != ref.mem_addr))
+        report_mismatch(e, rec, ref, "address");
+    else
+        matched++;
+}
+
+void CoSim::print()
+{
+    ostream &log = sim->log();
+    log << endl << "[Co-simulation]" << endl;
+    log << matched << " instructions matched." << endl;
+    if (is_mismatched || is_invalid)
+        return;
+    if (is_ended)
+        log << "The reference trace ended first." << endl;
+    else {
+        TraceRecord ref;
+        if (parse_line(ref))
+            log << "The reference trace continues at " << hex << setw(8) << setfill('0') << ref.pc << dec << "." << endl;
+    }
+}
@@ -1,4 +1,5 @@
 #include <cmath>
+#include <cstring>
 #include <cfenv>
 #include <vector>
 #include <utility>
@@ -86,7 +87,9 @@ string inst_type_to_string(InstType t)
     }
 }
 
-CPU::CPU(uint32_t mem_size, vector<uint32_t> static_data)
+CPU::CPU(Simulator *sim, uint32_t mem_size, const uint32_t *static_data, uint32_t data_len, uint32_t text_len,
+         GuestIO *io, bool is_guard_mem)
+    : sim(sim), mem(mem_size, is_guard_mem), io(io), exec_count(text_len, 0)
 {
     pc = 0;
     prev_pc = 0;
@@ -95,19 +98,51 @@ CPU::CPU(uint32_t mem_size, vector<uint32_t> static_data)
         r_max[i] = 0;
         f[i] = 0;
     }
-    mem = vector<uint32_t>(mem_size);
     this->mem_size = mem_size;
-    copy(static_data.begin(), static_data.end(), mem.begin());
+    copy(static_data, static_data + data_len, mem.data());
     halted_f = false;
     exception_f = false;
+    show_max_f = sim->get_options().is_show_max;
     clocks = 0;
-    for (int i = 0; i < INST_LEN; i++) {
-        inst_stat[i] = 0;
-    }
+    undo_log = nullptr;
+    threaded_handlers = nullptr;
+    jit = nullptr;
 }
 
 CPU::~CPU()
 {
+    release_jit();
+}
+
+bool CPU::reset(const uint32_t *static_data, uint32_t data_len)
+{
+    if (!mem.clear())
+        return false;
+    copy(static_data, static_data + data_len, mem.data());
+    pc = 0;
+    prev_pc = 0;
+    fill(r, r + REG_LEN, 0);
+    fill(r_max, r_max + REG_LEN, 0);
+    fill(f, f + REG_LEN, 0);
+    fill(exec_count.begin(), exec_count.end(), 0);
+    halted_f = false;
+    exception_f = false;
+    show_max_f = sim->get_options().is_show_max;
+    clocks = 0;
+    return true;
+}
+
+uint64_t CPU::state_hash()
+{
+    uint64_t h = mem.content_hash();
+    h = (h ^ pc) * 0x100000001b3;
+    for (uint32_t i = 0; i < REG_LEN; i++) {
+        uint32_t bits;
+        memcpy(&bits, &f[i], sizeof(bits));
+        h = (h ^ r[i]) * 0x100000001b3;
+        h = (h ^ bits) * 0x100000001b3;
+    }
+    return h;
 }
 
 uint32_t CPU::get_r(uint32_t ri)
@@ -124,6 +159,44 @@ float CPU::get_f(uint32_t ri)
     return f[ri];
 }
 
+void CPU::set_r(uint32_t ri, uint32_t value)
+{
+    if (!(ri < CPU::REG_LEN))
+        throw out_of_range("CPU::set_r");
+    r[ri] = value;
+    flush_r0();
+}
+
+void CPU::set_f_bits(uint32_t ri, uint32_t bits)
+{
+    if (!(ri < CPU::REG_LEN))
+        throw out_of_range("CPU::set_f_bits");
+    memcpy(&f[ri], &bits, sizeof(bits));
+}
+
+void CPU::set_mem_word(uint32_t idx, uint32_t value)
+{
+    if (!(idx < mem_size))
+        throw out_of_range("CPU::set_mem_word");
+    mem[idx] = value;
+}
+
+void CPU::unretire(uint32_t pc, uint32_t prev_pc)
+{
+    this->pc = pc;
+    this->prev_pc = prev_pc;
+    clocks--;
+    exec_count[pc >> 2]--;
+    halted_f = false;
+    exception_f = false;
+}
+
+void CPU::record_undo()
+{
+    if (undo_log)
+        undo_log->record(pc, r, f, mem.data(), mem_size);
+}
+
 uint32_t CPU::get_mem(uint32_t addr)
 {
     if (addr & 0b11)
@@ -140,54 +213,74 @@ void CPU::update_pc(uint32_t new_pc)
     pc = new_pc;
 }
 
+ostream &CPU::log()
+{
+    return sim->log();
+}
+
+void CPU::print_line(uint32_t addr)
+{
+    sim->print_line(addr);
+}
+
 void CPU::report_NaN_exception(uint32_t rd)
 {
-    print_line_of_text_addr(pc);
-    cerr << "NaN value appeared at f";
-    print_dec_2(rd);
-    cerr << ".";
-    cerr << endl << endl;
+    ostream &log = this->log();
+    print_line(pc);
+    log << "NaN value appeared at f";
+    print_dec_2(rd, log);
+    log << ".";
+    log << endl << endl;
     exception_f = true;
 }
 
 void CPU::print_state()
 {
-    cerr << endl << "[CPU State]" << endl;
-    cerr << "Elapsed "<< clocks << " clocks." << endl << endl;
-    cerr << "PC = ";
-    print_hex(pc);
-    cerr << " (" << pc << ")" << endl;
+    ostream &log = this->log();
+    log << endl << "[CPU State]" << endl;
+    log << "Elapsed "<< clocks << " clocks." << endl << endl;
+    log << "PC = ";
+    print_hex(pc, log);
+    log << " (" << pc << ")" << endl;
 
-    cerr << "GPRs:" << endl;
+    log << "GPRs:" << endl;
     for (int i = 0; i < REG_LEN; i++) {
-        cerr << "x";
-        print_dec_2(i);
-        cerr << " = ";
-        print_dec_10(r[i]);
-        cerr << ";";
+        log << "x";
+        print_dec_2(i, log);
+        log << " = ";
+        print_dec_10(r[i], log);
+        log << ";";
         if (i % 4 == 3)
-            cerr << endl;
+            log << endl;
         else
-            cerr << " ";
+            log << " ";
     }
 
-    cerr << "FPRs:" << endl;
+    log << "FPRs:" << endl;
     for (int i = 0; i < REG_LEN; i++) {
-        cerr << "f";
-        print_dec_2(i);
-        cerr << " = ";
-        cerr << setprecision(5) << scientific << f[i];
-        cerr << ";";
+        log << "f";
+        print_dec_2(i, log);
+        log << " = ";
+        log << setprecision(5) << scientific << f[i];
+        log << ";";
         if (i % 4 == 3)
-            cerr << endl;
+            log << endl;
         else
-            cerr << " ";
+            log << " ";
     }
 }
 
-void CPU::print_inst_stat(bool is_sort)
+// derived from the per-PC execution counts; invalid words are not counted
+void CPU::print_inst_stat(const vector<DecodedInst> &dinsts, bool is_sort)
 {
-    cerr << endl << "[Instruction statistics]" << endl;
+    ostream &log = this->log();
+    log << endl << "[Instruction statistics]" << endl;
+
+    uint64_t inst_stat[INST_LEN] = {};
+    for (uint32_t i = 0; i < dinsts.size(); i++) {
+        if (dinsts[i].type != InstType::sentinel)
+            inst_stat[static_cast<int>(dinsts[i].type)] += exec_count[i];
+    }
 
     vector<pair<uint64_t, InstType>> stat;
 
@@ -198,24 +291,33 @@ void CPU::print_inst_stat(bool is_sort)
         sort(stat.begin(), stat.end(), greater<pair<uint64_t, InstType>>());
 
     for (auto p : stat) {
-        cerr << setw(10) << inst_type_to_string(p.second) + ": " << p.first << endl;
+        log << setw(10) << inst_type_to_string(p.second) + ": " << p.first << endl;
     }
 }
 
+void CPU::print_mem_stat()
+{
+    ostream &log = this->log();
+    uint64_t pages = mem.peak_pages();
+    log << endl << "[Guest memory]" << endl;
+    log << "Peak resident pages: " << pages << " (" << pages * GuestMemory::page_size() / 1024 << " KiB)" << endl;
+}
+
 void CPU::print_max()
 {
-    cerr << endl << "[Register max values]" << endl;
-    cerr << "GPRs" << endl;
+    ostream &log = this->log();
+    log << endl << "[Register max values]" << endl;
+    log << "GPRs" << endl;
     for (int i = 0; i < REG_LEN; i++) {
-        cerr << "x";
-        print_dec_2(i);
-        cerr << " = ";
-        print_dec_10(r_max[i]);
-        cerr << ";";
+        log << "x";
+        print_dec_2(i, log);
+        log << " = ";
+        print_dec_10(r_max[i], log);
+        log << ";";
         if (i % 4 == 3)
-            cerr << endl;
+            log << endl;
         else
-            cerr << " ";
+            log << " ";
     }
 }
 
@@ -228,8 +330,6 @@ void CPU::update_max()
 
 void CPU::add(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::add)]++;
-
     r[rd] = r[rs1] + r[rs2];
     flush_r0();
     inc_pc();
@@ -237,8 +337,6 @@ void CPU::add(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::sub(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::sub)]++;
-
     r[rd] = r[rs1] - r[rs2];
     flush_r0();
     inc_pc();
@@ -246,8 +344,6 @@ void CPU::sub(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::or_(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::or_)]++;
-
     r[rd] = r[rs1] | r[rs2];
     flush_r0();
     inc_pc();
@@ -255,8 +351,6 @@ void CPU::or_(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fadd(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fadd)]++;
-
     f[rd] = f[rs1] + f[rs2];
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -266,8 +360,6 @@ void CPU::fadd(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fsub(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fsub)]++;
-
     f[rd] = f[rs1] - f[rs2];
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -277,8 +369,6 @@ void CPU::fsub(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fmul(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fmul)]++;
-
     f[rd] = f[rs1] * f[rs2];
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -288,8 +378,6 @@ void CPU::fmul(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fdiv(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fdiv)]++;
-
     f[rd] = f[rs1] / f[rs2];
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -299,8 +387,6 @@ void CPU::fdiv(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fsqrt(uint32_t rd, uint32_t rs1)
 {
-    inst_stat[static_cast<int>(InstType::fsqrt)]++;
-
     f[rd] = sqrtf(f[rs1]);
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -310,8 +396,6 @@ void CPU::fsqrt(uint32_t rd, uint32_t rs1)
 
 void CPU::fsgnj(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fsgnj)]++;
-
     uint32_t res = ((*(uint32_t *)&f[rs1]) & 0x7fffffff) | ((*(uint32_t *)&f[rs2]) & 0x80000000);
     f[rd] = *(float *)&res;
     if (isnan(f[rd]))
@@ -322,8 +406,6 @@ void CPU::fsgnj(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fsgnjn(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fsgnjn)]++;
-
     uint32_t res = ((*(uint32_t *)&f[rs1]) & 0x7fffffff) | (~(*(uint32_t *)&f[rs2]) & 0x80000000);
     f[rd] = *(float *)&res;
     if (isnan(f[rd]))
@@ -334,8 +416,6 @@ void CPU::fsgnjn(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fsgnjx(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fsgnjx)]++;
-
     uint32_t res = ((*(uint32_t *)&f[rs1]) & 0x7fffffff) | (((*(uint32_t *)&f[rs1]) & 0x80000000) ^ ((*(uint32_t *)&f[rs2]) & 0x80000000));
     f[rd] = *(float *)&res;
     if (isnan(f[rd]))
@@ -346,8 +426,6 @@ void CPU::fsgnjx(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::feq(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::feq)]++;
-
     r[rd] = f[rs1] == f[rs2];
     flush_r0();
     inc_pc();
@@ -355,8 +433,6 @@ void CPU::feq(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fle(uint32_t rd, uint32_t rs1, uint32_t rs2)
 {
-    inst_stat[static_cast<int>(InstType::fle)]++;
-
     r[rd] = f[rs1] <= f[rs2];
     flush_r0();
     inc_pc();
@@ -364,8 +440,6 @@ void CPU::fle(uint32_t rd, uint32_t rs1, uint32_t rs2)
 
 void CPU::fcvt_w_s(uint32_t rd, uint32_t rs1)
 {
-    inst_stat[static_cast<int>(InstType::fcvt_w_s)]++;
-
     fesetround(FE_TONEAREST);
     r[rd] = (uint32_t)((int32_t)nearbyintf(f[rs1]));
     flush_r0();
@@ -375,8 +449,6 @@ void CPU::fcvt_w_s(uint32_t rd, uint32_t rs1)
 
 void CPU::fcvt_s_w(uint32_t rd, uint32_t rs1)
 {
-    inst_stat[static_cast<int>(InstType::fcvt_s_w)]++;
-
     f[rd] = (int32_t)r[rs1];
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -386,8 +458,6 @@ void CPU::fcvt_s_w(uint32_t rd, uint32_t rs1)
 
 void CPU::fmv_s_x(uint32_t rd, uint32_t rs1)
 {
-    inst_stat[static_cast<int>(InstType::fmv_s_x)]++;
-
     f[rd] = *(float *)&r[rs1];
     if (isnan(f[rd]))
         report_NaN_exception(rd);
@@ -397,8 +467,6 @@ void CPU::fmv_s_x(uint32_t rd, uint32_t rs1)
 
 void CPU::addi(uint32_t rd, uint32_t rs, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::addi)]++;
-
     r[rd] = r[rs] + imm;
     flush_r0();
     inc_pc();
@@ -406,8 +474,6 @@ void CPU::addi(uint32_t rd, uint32_t rs, int32_t imm)
 
 void CPU::slli(uint32_t rd, uint32_t rs, uint32_t shamt)
 {
-    inst_stat[static_cast<int>(InstType::slli)]++;
-
     r[rd] = r[rs] << shamt;
     flush_r0();
     inc_pc();
@@ -415,8 +481,6 @@ void CPU::slli(uint32_t rd, uint32_t rs, uint32_t shamt)
 
 void CPU::srai(uint32_t rd, uint32_t rs, uint32_t shamt)
 {
-    inst_stat[static_cast<int>(InstType::srai)]++;
-
     int32_t res = (*(int32_t *)&r[rs]) >> shamt;
     r[rd] = *(uint32_t *)&res;
     flush_r0();
@@ -425,27 +489,22 @@ void CPU::srai(uint32_t rd, uint32_t rs, uint32_t shamt)
 
 void CPU::lw(uint32_t rd, uint32_t rs, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::lw)]++;
-
     uint32_t addr = r[rs] + imm, idx = addr >> 2;
     if (idx < mem_size) {
         r[rd] = mem[idx];
         flush_r0();
         inc_pc();
     } else {
-        print_line_of_text_addr(pc);
-        cerr << "Invalid memory access. addr = ";
-        print_hex(addr);
-        cerr << " (" << addr << ")";
-        cerr << endl << endl;
+        print_line(pc);
+        log() << "Invalid memory access. addr = ";
+        print_hex(addr, log());
+        log() << " (" << addr << ")" << endl << endl;
         exception_f = true;
     }
 }
 
 void CPU::flw(uint32_t rd, uint32_t rs, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::flw)]++;
-
     uint32_t addr = r[rs] + imm, idx = addr >> 2;
     if (idx < mem_size) {
         f[rd] = *(float *)&mem[idx];
@@ -453,19 +512,16 @@ void CPU::flw(uint32_t rd, uint32_t rs, int32_t imm)
             report_NaN_exception(rd);
         inc_pc();
     } else {
-        print_line_of_text_addr(pc);
-        cerr << "Invalid memory access. addr = ";
-        print_hex(addr);
-        cerr << " (" << addr << ")";
-        cerr << endl << endl;
+        print_line(pc);
+        log() << "Invalid memory access. addr = ";
+        print_hex(addr, log());
+        log() << " (" << addr << ")" << endl << endl;
         exception_f = true;
     }
 }
 
 void CPU::jalr(uint32_t rd, uint32_t rs, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::jalr)]++;
-
     r[rd] = pc + WORD_SIZE;
     flush_r0();
     update_pc(r[rs] + imm);
@@ -473,44 +529,36 @@ void CPU::jalr(uint32_t rd, uint32_t rs, int32_t imm)
 
 void CPU::sw(uint32_t rs2, uint32_t rs1, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::sw)]++;
-
     uint32_t addr = r[rs1] + imm, idx = addr >> 2;
     if (idx < mem_size) {
         mem[idx] = r[rs2];
         inc_pc();
     } else {
-        print_line_of_text_addr(pc);
-        cerr << "Invalid memory access. addr = ";
-        print_hex(addr);
-        cerr << " (" << addr << ")";
-        cerr << endl << endl;
+        print_line(pc);
+        log() << "Invalid memory access. addr = ";
+        print_hex(addr, log());
+        log() << " (" << addr << ")" << endl << endl;
         exception_f = true;
     }
 }
 
 void CPU::fsw(uint32_t rs2, uint32_t rs1, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::fsw)]++;
-
     uint32_t addr = r[rs1] + imm, idx = addr >> 2;
     if (idx < mem_size) {
         mem[idx] = *(uint32_t *)&f[rs2];
         inc_pc();
     } else {
-        print_line_of_text_addr(pc);
-        cerr << "Invalid memory access. addr = ";
-        print_hex(addr);
-        cerr << " (" << addr << ")";
-        cerr << endl << endl;
+        print_line(pc);
+        log() << "Invalid memory access. addr = ";
+        print_hex(addr, log());
+        log() << " (" << addr << ")" << endl << endl;
         exception_f = true;
     }
 }
 
 void CPU::beq(uint32_t rs1, uint32_t rs2, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::beq)]++;
-
     if (r[rs1] == r[rs2])
         update_pc(pc + imm);
     else
@@ -519,8 +567,6 @@ void CPU::beq(uint32_t rs1, uint32_t rs2, int32_t imm)
 
 void CPU::bne(uint32_t rs1, uint32_t rs2, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::bne)]++;
-
     if (r[rs1] != r[rs2])
         update_pc(pc + imm);
     else
@@ -529,8 +575,6 @@ void CPU::bne(uint32_t rs1, uint32_t rs2, int32_t imm)
 
 void CPU::blt(uint32_t rs1, uint32_t rs2, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::blt)]++;
-
     if (*(int32_t *)(r + rs1) < *(int32_t *)(r + rs2))
         update_pc(pc + imm);
     else
@@ -539,8 +583,6 @@ void CPU::blt(uint32_t rs1, uint32_t rs2, int32_t imm)
 
 void CPU::bge(uint32_t rs1, uint32_t rs2, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::bge)]++;
-
     if (*(int32_t *)(r + rs1) >= *(int32_t *)(r + rs2))
         update_pc(pc + imm);
     else
@@ -549,8 +591,6 @@ void CPU::bge(uint32_t rs1, uint32_t rs2, int32_t imm)
 
 void CPU::lui(uint32_t rd, uint32_t imm_u)
 {
-    inst_stat[static_cast<int>(InstType::lui)]++;
-
     r[rd] = imm_u | (r[rd] & 0x00000fff); // preserve the lowest 12 bits
     flush_r0();
 
@@ -559,8 +599,6 @@ void CPU::lui(uint32_t rd, uint32_t imm_u)
 
 void CPU::jal(uint32_t rd, int32_t imm)
 {
-    inst_stat[static_cast<int>(InstType::jal)]++;
-
     r[rd] = pc + WORD_SIZE;
     flush_r0();
     update_pc(pc + imm);
@@ -568,18 +606,12 @@ void CPU::jal(uint32_t rd, int32_t imm)
 
 void CPU::halt()
 {
-    inst_stat[static_cast<int>(InstType::halt)]++;
-
     halted_f = true;
 }
 
 void CPU::inb(uint32_t rd)
 {
-    inst_stat[static_cast<int>(InstType::inb)]++;
-
-    char c;
-    in_file.get(c);
-    r[rd] = *(unsigned char *)&c; // clears upper 24 bits
+    r[rd] = io->get(); // clears upper 24 bits
     flush_r0();
 
     inc_pc();
@@ -587,9 +619,7 @@ void CPU::inb(uint32_t rd)
 
 void CPU::outb(uint32_t rs1)
 {
-    inst_stat[static_cast<int>(InstType::outb)]++;
-
-    cout << (char)r[rs1];
+    io->put((char)r[rs1]);
 
     inc_pc();
 }
@@ -6,49 +6,20 @@ using namespace std;
 
 #include "common.h"
 
-uint32_t get_word_of_text_addr(uint32_t addr)
+void print_prompt(Simulator *sim)
 {
-    if (addr & 0b11)
-        throw invalid_argument("get_word_of_text_addr");
-    uint32_t idx = addr >> 2;
-    if (!(idx < insts.size()))
-        throw out_of_range("get_word_of_text_addr");
-    return insts[idx];
-}
-
-void print_line_of_text_addr(uint32_t addr)
-{
-    if (addr & 0b11)
-        throw invalid_argument("print_line_of_text_addr");
-    uint32_t idx = addr >> 2;
-    if (!(idx < insts.size()))
-        throw out_of_range("print_line_of_text_addr");
-    uint32_t cur_lnum = inst_lines[idx];
-    string cur_line = lines[cur_lnum - 1];
-    cerr << cur_lnum << ": " << cur_line << endl;
-}
-
-uint32_t text_addr_of_lnum(uint32_t lnum)
-{
-    uint32_t idx = distance(inst_lines.begin(), lower_bound(inst_lines.begin(), inst_lines.end(), lnum));
-    if (idx >= inst_lines.size())
-        throw out_of_range("text_addr_of_line_number");
-    return idx << 2;
-}
-
-void print_prompt()
-{
-    print_line_of_text_addr(cpu->get_pc());
-    cerr << "[" << cpu->get_clocks() << " clks] ";
+    sim->io().flush();
+    sim->print_line(sim->get_cpu()->get_pc());
+    cerr << "[" << sim->get_cpu()->get_clocks() << " clks] ";
     cerr << "> ";
 }
 
-void print_breakpoint(uint32_t bp)
+void print_breakpoint(Simulator *sim, uint32_t bp)
 {
     cerr << "(";
     print_hex(bp);
     cerr << ") ";
-    print_line_of_text_addr(bp);
+    sim->print_line(bp);
 }
 
 void print_as_hex(uint32_t n)
@@ -78,30 +49,9 @@ void print_as_bin(uint32_t n)
     cerr << "(bin)   " << "0b" << num_to_bin(n) << endl;
 }
 
-set<uint32_t> breakpoints;
-
-bool is_breakpoint()
-{
-    return breakpoints.find(cpu->get_pc()) != breakpoints.end();
-}
-
-void add_breakpoint(uint32_t bp)
-{
-    breakpoints.insert(bp);
-}
-
-void delete_breakpoint(uint32_t bp)
-{
-    breakpoints.erase(bp); // doesn't care result
-}
-
-void delete_all_breakpoints()
-{
-    breakpoints.clear();
-}
-
-bool process_command(string cmd_line)
+bool process_command(Simulator *sim, UndoLog *undo_log, string cmd_line)
 {
+    CPU *cpu = sim->get_cpu();
     if (cmd_line == "")
         cmd_line = "next";
     vector<string> elems = split_string(cmd_line, " ");
@@ -110,7 +60,7 @@ bool process_command(string cmd_line)
 
     if (cmd[0] == 'n') { // next
         if (args.empty())
-            return step_and_report(true);
+            return step_and_report(sim, true);
         else {
             int cnt;
             try {
@@ -120,9 +70,9 @@ bool process_command(string cmd_line)
                 return true;
             }
             for (int i = 0; i < cnt; i++) {
-                if (!step_and_report(true))
+                if (!step_and_report(sim, true))
                     return false;
-                if (is_breakpoint()) {
+                if (sim->is_breakpoint()) {
                     cerr << "Stop at breakpoint." << endl << endl;
                     break;
                 }
@@ -130,54 +80,122 @@ bool process_command(string cmd_line)
             return true;
         }
     }
+    else if (cmd == "continue-until-clock") {
+        uint64_t until;
+        try {
+            until = stoull(args.at(0));
+        } catch (...) {
+            cerr << "Invalid argument." << endl;
+            return true;
+        }
+        if (until <= cpu->get_clocks()) {
+            cerr << "Already at " << cpu->get_clocks() << " clocks." << endl << endl;
+            return true;
+        }
+        if (!continue_and_report(sim, true, until))
+            return false;
+        if (sim->is_breakpoint() && cpu->get_clocks() < until)
+            cerr << "Stop at breakpoint." << endl << endl;
+        else
+            cerr << "Stop at " << cpu->get_clocks() << " clocks." << endl << endl;
+    }
     else if (cmd[0] == 'c') { // continue
+        if (!continue_and_report(sim, true))
+            return false;
+        if (sim->is_breakpoint())
+            cerr << "Stop at breakpoint." << endl << endl;
+    }
+    else if (cmd[0] == 'q') // quit
+        return false;
+    else if (cmd[0] == 's') { // save checkpoint
+        if (args.empty())
+            cerr << "Please specify an argument." << endl;
+        else if (!sim->save_checkpoint(args[0]))
+            cerr << "Cannot write checkpoint." << endl << endl;
+        else
+            cerr << "Saved checkpoint at " << cpu->get_clocks() << " clocks." << endl << endl;
+    }
+    else if (cmd == "restore") { // restore checkpoint
+        string error;
+        if (args.empty())
+            cerr << "Please specify an argument." << endl;
+        else if (!sim->restore_checkpoint(args[0], error))
+            cerr << "Cannot restore checkpoint: " << error << "." << endl << endl;
+        else {
+            if (undo_log)
+                undo_log->clear();
+            cerr << "Restored checkpoint at " << cpu->get_clocks() << " clocks." << endl << endl;
+        }
+    }
+    else if (cmd == "back") { // step back
+        int cnt = 1;
+        if (!args.empty()) {
+            try {
+                cnt = stoi(args[0]);
+            } catch (...) {
+                cerr << "Invalid argument." << endl;
+                return true;
+            }
+        }
+        for (int i = 0; i < cnt; i++) {
+            if (!undo_log || !undo_log->step_back()) {
+                cerr << "No more history." << endl << endl;
+                break;
+            }
+            if (sim->is_breakpoint()) {
+                cerr << "Stop at breakpoint." << endl << endl;
+                break;
+            }
+        }
+    }
+    else if (cmd[0] == 'r') { // reverse-continue
         for (;;) {
-            if (!step_and_report(true))
-                return false;
-            if (is_breakpoint()) {
+            if (!undo_log || !undo_log->step_back()) {
+                cerr << "No more history." << endl << endl;
+                break;
+            }
+            if (sim->is_breakpoint()) {
                 cerr << "Stop at breakpoint." << endl << endl;
                 break;
             }
         }
     }
-    else if (cmd[0] == 'q') // quit
-        return false;
     else if (cmd[0] == 'b') { // breakpoint
         if (args.empty()) {
-            add_breakpoint(cpu->get_pc());
+            sim->add_breakpoint(cpu->get_pc());
             cerr << "Add breakpoint." << endl << endl;
         } else {
             string arg = args[0];
             if (arg == "-s") { // show breakpoint
-                if (breakpoints.size() == 0)
+                if (sim->get_breakpoints().size() == 0)
                     cerr << "No";
                 else
-                    cerr << breakpoints.size();
+                    cerr << sim->get_breakpoints().size();
                 cerr << " breakpoint(s)." << endl;
 
-                for (uint32_t bp : breakpoints)
-                    print_breakpoint(bp);
+                for (uint32_t bp : sim->get_breakpoints())
+                    print_breakpoint(sim, bp);
                 cerr << endl;
             } else {
                 uint32_t bp;
                 if (isdigit(arg[0])) {
                     try {
-                        bp = text_addr_of_lnum(stoul(arg));
+                        bp = sim->text_addr_of_lnum(stoul(arg));
                     } catch (...) {
                         cerr << "Invalid argument." << endl;
                         return true;
                     }
                 } else {
                     try {
-                        bp = text_addr_of_lnum(lnum_of_label(arg));
+                        bp = sim->text_addr_of_lnum(sim->lnum_of_label(arg));
                     } catch (...) {
                         cerr << "Invalid argument." << endl;
                         return true;
                     }
                 }
-                add_breakpoint(bp);
+                sim->add_breakpoint(bp);
                 cerr << "Add breakpoint at" << endl;
-                print_breakpoint(bp);
+                print_breakpoint(sim, bp);
                 cerr << endl;
             }
         }
@@ -189,27 +207,27 @@ bool process_command(string cmd_line)
             string arg = args[0];
             if (arg == "-a") {
                 cerr << "Delete all breakpoints." << endl << endl;
-                delete_all_breakpoints();
+                sim->delete_all_breakpoints();
             } else {
                 uint32_t bp;
                 if (isdigit(arg[0])) {
                     try {
-                        bp = text_addr_of_lnum(stoul(arg));
+                        bp = sim->text_addr_of_lnum(stoul(arg));
                     } catch (...) {
                         cerr << "Invalid argument." << endl;
                         return true;
                     }
                 } else {
                     try {
-                        bp = text_addr_of_lnum(lnum_of_label(arg));
+                        bp = sim->text_addr_of_lnum(sim->lnum_of_label(arg));
                     } catch (...) {
                         cerr << "Invalid argument." << endl;
                         return true;
                     }
                 }
-                delete_breakpoint(bp);
+                sim->delete_breakpoint(bp);
                 cerr << "Delete breakpoint at" << endl;
-                print_breakpoint(bp);
+                print_breakpoint(sim, bp);
                 cerr << endl;
             }
         }
@@ -255,8 +273,8 @@ bool process_command(string cmd_line)
             }
 
             if (is_inst) {
-                print_line_of_text_addr(val);
-                uint32_t word = get_word_of_text_addr(val);
+                sim->print_line(val);
+                uint32_t word = sim->get_word_of_text_addr(val);
                 print_as_hex(word);
                 print_as_bin(word);
                 cerr << endl;
@@ -4,19 +4,8 @@
 
 #include "common.h"
 
-bool step_exec(CPU *cpu, const vector<uint32_t> &insts)
+DecodedInst decode_inst(uint32_t word)
 {
-    uint32_t cur_addr = cpu->get_pc();
-    uint32_t idx = cur_addr >> 2;
-    if (idx >= insts.size()) {
-        print_line_of_text_addr(cpu->get_prev_pc());
-        cerr << "PC is out of range." << endl << endl;
-        return false;
-    }
-    is_unreached_index[idx] = false;
-
-    uint32_t word = insts[idx];
-
     uint32_t opcode, rd, funct3, funct7, rs1, rs2;
     opcode = word & 0b1111111;
     rd = (word >> 7) & 0b11111;
@@ -25,141 +14,300 @@ bool step_exec(CPU *cpu, const vector<uint32_t> &insts)
     rs1 = (word >> 15) & 0b11111;
     rs2 = (word >> 20) & 0b11111;
 
-    bool is_invalid = false;
+    DecodedInst inst;
+    inst.type = InstType::sentinel;
+    inst.rd = rd;
+    inst.rs1 = rs1;
+    inst.rs2 = rs2;
+    inst.imm = 0;
 
     if (opcode == 0b0110011) { // R type
         if (funct3 == 0b000) {
             if (funct7 == 0b0000000)
-                cpu->add(rd, rs1, rs2);
+                inst.type = InstType::add;
             else if (funct7 == 0b0100000)
-                cpu->sub(rd, rs1, rs2);
-            else
-                is_invalid = true;
+                inst.type = InstType::sub;
         }
         else if (funct3 == 0b110 && funct7 == 0b0000000)
-            cpu->or_(rd, rs1, rs2);
-        else
-            is_invalid = true;
+            inst.type = InstType::or_;
     } else if (opcode == 0b1010011) { // RV32F, R type
         if (funct7 == 0b0000000 && funct3 == 0b000)
-            cpu->fadd(rd, rs1, rs2);
+            inst.type = InstType::fadd;
         else if (funct7 == 0b0000100 && funct3 == 0b000)
-            cpu->fsub(rd, rs1, rs2);
+            inst.type = InstType::fsub;
         else if (funct7 == 0b0001000 && funct3 == 0b000)
-            cpu->fmul(rd, rs1, rs2);
+            inst.type = InstType::fmul;
         else if (funct7 == 0b0001100 && funct3 == 0b000)
-            cpu->fdiv(rd, rs1, rs2);
+            inst.type = InstType::fdiv;
         else if (funct7 == 0b0101100 && funct3 == 0b000 && rs2 == 0b00000)
-            cpu->fsqrt(rd, rs1);
+            inst.type = InstType::fsqrt;
         else if (funct7 == 0b0010000) {
             if (funct3 == 0b000)
-                cpu->fsgnj(rd, rs1, rs2);
+                inst.type = InstType::fsgnj;
             else if (funct3 == 0b001)
-                cpu->fsgnjn(rd, rs1, rs2);
+                inst.type = InstType::fsgnjn;
             else if (funct3 == 0b010)
-                cpu->fsgnjx(rd, rs1, rs2);
-            else
-                is_invalid = true;
+                inst.type = InstType::fsgnjx;
         }
         else if (funct7 == 0b1100000 && funct3 == 0b000) {
             if (rs2 == 0b00000)
-                cpu->fcvt_w_s(rd, rs1);
-            else
-                is_invalid = true;
+                inst.type = InstType::fcvt_w_s;
         }
-        else if (funct7 == 0b1010000)
+        else if (funct7 == 0b1010000) {
             if (funct3 == 0b010)
-                cpu->feq(rd, rs1, rs2);
+                inst.type = InstType::feq;
             else if (funct3 == 0b000)
-                cpu->fle(rd, rs1, rs2);
-            else
-                is_invalid = true;
+                inst.type = InstType::fle;
+        }
         else if (funct7 == 0b1101000 && funct3 == 0b000 && rs2 == 0b00000)
-            cpu->fcvt_s_w(rd, rs1);
+            inst.type = InstType::fcvt_s_w;
         else if (funct7 == 0b1111000 && funct3 == 0b000 && rs2 == 0b00000)
-            cpu->fmv_s_x(rd, rs1);
-        else
-            is_invalid = true;
+            inst.type = InstType::fmv_s_x;
     } else if (opcode == 0b0100011 || opcode == 0b0100111) { // S type
         uint32_t imm_lo = (word >> 25) << 5 | rd;
         uint32_t imm_u = (imm_lo >> 11) ? (0xfffff000 | imm_lo) : imm_lo; // sign extension
-        int32_t imm = *(int32_t *)&imm_u;
+        inst.imm = *(int32_t *)&imm_u;
 
         if (opcode == 0b0100011 && funct3 == 0b010)
-            cpu->sw(rs2, rs1, imm);
+            inst.type = InstType::sw;
         else if (opcode == 0b0100111 && funct3 == 0b010)
-            cpu->fsw(rs2, rs1, imm);
-        else
-            is_invalid = true;
+            inst.type = InstType::fsw;
     } else if (opcode == 0b1100011) { // SB type
         uint32_t imm_lo = (word >> 31) << 12 | (word & 0b10000000) << 4 | (word & 0x7e000000) >> 20 | (word & 0xf00) >> 7;
         uint32_t imm_u = (imm_lo >> 12) ? (0xffffe000 | imm_lo) : imm_lo;
-        int32_t imm = *(int32_t *)&imm_u;
+        inst.imm = *(int32_t *)&imm_u;
 
         if (funct3 == 0b000)
-            cpu->beq(rs1, rs2, imm);
+            inst.type = InstType::beq;
         else if (funct3 == 0b001)
-            cpu->bne(rs1, rs2, imm);
+            inst.type = InstType::bne;
         else if (funct3 == 0b100)
-            cpu->blt(rs1, rs2, imm);
+            inst.type = InstType::blt;
         else if (funct3 == 0b101)
-            cpu->bge(rs1, rs2, imm);
-        else
-            is_invalid = true;
+            inst.type = InstType::bge;
     } else if (opcode == 0b0110111) { // U type
         uint32_t imm_u = word & 0xfffff000;
-        cpu->lui(rd, imm_u);
+        inst.imm = *(int32_t *)&imm_u;
+        inst.type = InstType::lui;
     } else if (opcode == 0b1101111) { // UJ type
         uint32_t imm_lo = (word >> 31) << 20 | (word & 0xff000) | (word & 0x100000) >> 9 | (word & 0x7fe00000) >> 20;
         uint32_t imm_u = (imm_lo >> 20) ? (0xffe00000 | imm_lo) : imm_lo;
-        int32_t imm = *(int32_t *)&imm_u;
-
-        cpu->jal(rd, imm);
+        inst.imm = *(int32_t *)&imm_u;
+        inst.type = InstType::jal;
     } else if (opcode == 0b0001011 && funct7 == 0 && rs2 == 0) {
         if (funct3 == 0b100 && rd == 0 && rs1 == 0)
-            cpu->halt();
+            inst.type = InstType::halt;
         else if (funct3 == 0b001 && rs1 == 0)
-            cpu->inb(rd);
+            inst.type = InstType::inb;
         else if (funct3 == 0b010 && rd == 0)
-            cpu->outb(rs1);
-        else
-            is_invalid = true;
+            inst.type = InstType::outb;
     } else { // I type
         uint32_t imm_lo = word >> 20;
         uint32_t shamt = imm_lo & 0b11111;
         uint32_t imm_u = (imm_lo >> 11) ? (0xfffff000 | imm_lo) : imm_lo;
-        int32_t imm = *(int32_t *)&imm_u;
+        inst.imm = *(int32_t *)&imm_u;
 
         if (opcode == 0b0010011) {
             if (funct3 == 0b000)
-                cpu->addi(rd, rs1, imm);
-            else if (funct3 == 0b001 && funct7 == 0b0000000)
-                cpu->slli(rd, rs1, shamt);
-            else if (funct3 == 0b101 && funct7 == 0b0100000)
-                cpu->srai(rd, rs1, shamt);
-            else
-                is_invalid = true;
+                inst.type = InstType::addi;
+            else if (funct3 == 0b001 && funct7 == 0b0000000) {
+                inst.type = InstType::slli;
+                inst.imm = shamt;
+            }
+            else if (funct3 == 0b101 && funct7 == 0b0100000) {
+                inst.type = InstType::srai;
+                inst.imm = shamt;
+            }
         }
         else if (opcode == 0b0000011 && funct3 == 0b010)
-            cpu->lw(rd, rs1, imm);
+            inst.type = InstType::lw;
         else if (opcode == 0b0000111 && funct3 == 0b010)
-            cpu->flw(rd, rs1, imm);
+            inst.type = InstType::flw;
         else if (opcode == 0b1100111 && funct3 == 0b000)
-            cpu->jalr(rd, rs1, imm);
-        else
-            is_invalid = true;
+            inst.type = InstType::jalr;
+    }
+
+    return inst;
+}
+
+// invalid words are kept as InstType::sentinel and reported when reached
+vector<DecodedInst> decode_insts(const uint32_t *insts, uint32_t len)
+{
+    vector<DecodedInst> dinsts(len);
+    transform(insts, insts + len, dinsts.begin(), decode_inst);
+    return dinsts;
+}
+
+Operands operands_of(InstType t)
+{
+    const RegKind N = RegKind::none, X = RegKind::x, F = RegKind::f;
+    switch (t) {
+        case InstType::add: case InstType::sub: case InstType::or_:
+            return {X, X, X};
+        case InstType::fadd: case InstType::fsub: case InstType::fmul: case InstType::fdiv:
+        case InstType::fsgnj: case InstType::fsgnjn: case InstType::fsgnjx:
+            return {F, F, F};
+        case InstType::fsqrt:
+            return {F, F, N};
+        case InstType::feq: case InstType::fle:
+            return {X, F, F};
+        case InstType::fcvt_w_s:
+            return {X, F, N};
+        case InstType::fcvt_s_w: case InstType::fmv_s_x:
+            return {F, X, N};
+        case InstType::addi: case InstType::slli: case InstType::srai: case InstType::lw: case InstType::jalr:
+            return {X, X, N};
+        case InstType::flw:
+            return {F, X, N};
+        case InstType::sw: case InstType::beq: case InstType::bne: case InstType::blt: case InstType::bge:
+            return {N, X, X};
+        case InstType::fsw:
+            return {N, X, F};
+        case InstType::lui: case InstType::jal: case InstType::inb: // lui also keeps the low 12 bits of rd
+            return {X, N, N};
+        case InstType::outb:
+            return {N, X, N};
+        default:
+            return {N, N, N};
     }
+}
 
-    if (is_invalid) {
-        print_line_of_text_addr(cpu->get_pc());
-        cerr << "Invalid instruction." << endl << endl;
+bool step_exec(CPU *cpu, const vector<DecodedInst> &dinsts)
+{
+    uint32_t cur_addr = cpu->get_pc();
+    uint32_t idx = cur_addr >> 2;
+    if (idx >= dinsts.size()) {
+        cpu->print_line(cpu->get_prev_pc());
+        cpu->log() << "PC is out of range." << endl << endl;
         return false;
     }
+    cpu->count_exec(idx);
+
+    const DecodedInst &inst = dinsts[idx];
+    uint32_t rd = inst.rd, rs1 = inst.rs1, rs2 = inst.rs2;
+    int32_t imm = inst.imm;
+    uint32_t mem_addr = cpu->get_r(rs1) + imm; // meaningful for loads and stores only
+    if (inst.type != InstType::sentinel)
+        cpu->record_undo();
+
+    switch (inst.type) {
+        // R type
+        case InstType::add:
+            cpu->add(rd, rs1, rs2);
+            break;
+        case InstType::sub:
+            cpu->sub(rd, rs1, rs2);
+            break;
+        case InstType::or_:
+            cpu->or_(rd, rs1, rs2);
+            break;
+        case InstType::fadd:
+            cpu->fadd(rd, rs1, rs2);
+            break;
+        case InstType::fsub:
+            cpu->fsub(rd, rs1, rs2);
+            break;
+        case InstType::fmul:
+            cpu->fmul(rd, rs1, rs2);
+            break;
+        case InstType::fsqrt:
+            cpu->fsqrt(rd, rs1);
+            break;
+        case InstType::fdiv:
+            cpu->fdiv(rd, rs1, rs2);
+            break;
+        case InstType::fsgnj:
+            cpu->fsgnj(rd, rs1, rs2);
+            break;
+        case InstType::fsgnjn:
+            cpu->fsgnjn(rd, rs1, rs2);
+            break;
+        case InstType::fsgnjx:
+            cpu->fsgnjx(rd, rs1, rs2);
+            break;
+        case InstType::feq:
+            cpu->feq(rd, rs1, rs2);
+            break;
+        case InstType::fle:
+            cpu->fle(rd, rs1, rs2);
+            break;
+        case InstType::fcvt_w_s:
+            cpu->fcvt_w_s(rd, rs1);
+            break;
+        case InstType::fcvt_s_w:
+            cpu->fcvt_s_w(rd, rs1);
+            break;
+        case InstType::fmv_s_x:
+            cpu->fmv_s_x(rd, rs1);
+            break;
+        // I type
+        case InstType::addi:
+            cpu->addi(rd, rs1, imm);
+            break;
+        case InstType::slli:
+            cpu->slli(rd, rs1, imm);
+            break;
+        case InstType::srai:
+            cpu->srai(rd, rs1, imm);
+            break;
+        case InstType::lw:
+            cpu->lw(rd, rs1, imm);
+            break;
+        case InstType::flw:
+            cpu->flw(rd, rs1, imm);
+            break;
+        case InstType::jalr:
+            cpu->jalr(rd, rs1, imm);
+            break;
+        // S type
+        case InstType::sw:
+            cpu->sw(rs2, rs1, imm);
+            break;
+        case InstType::fsw:
+            cpu->fsw(rs2, rs1, imm);
+            break;
+        // SB type
+        case InstType::beq:
+            cpu->beq(rs1, rs2, imm);
+            break;
+        case InstType::bne:
+            cpu->bne(rs1, rs2, imm);
+            break;
+        case InstType::blt:
+            cpu->blt(rs1, rs2, imm);
+            break;
+        case InstType::bge:
+            cpu->bge(rs1, rs2, imm);
+            break;
+        // U type
+        case InstType::lui:
+            cpu->lui(rd, imm);
+            break;
+        // UJ type
+        case InstType::jal:
+            cpu->jal(rd, imm);
+            break;
+        // original
+        case InstType::halt:
+            cpu->halt();
+            break;
+        case InstType::inb:
+            cpu->inb(rd);
+            break;
+        case InstType::outb:
+            cpu->outb(rs1);
+            break;
+        default: // invalid encoding
+            cpu->print_line(cpu->get_pc());
+            cpu->log() << "Invalid instruction." << endl << endl;
+            return false;
+    }
 
-    if (is_show_max)
+    if (cpu->is_show_max())
         cpu->update_max();
+    if (cpu->has_monitors())
+        cpu->notify_step(cur_addr, &inst, mem_addr);
 
     cpu->inc_clocks();
     return true;
 }
-
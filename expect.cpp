@@ -0,0 +1,200 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "common.h"
+
+const uint32_t EXPECT_NUMBER_MAX = 1000000000; // longer P3 values saturate
+
+OutputChecker::OutputChecker(Simulator *sim, uint32_t tolerance)
+    : sim(sim), tolerance(tolerance), base(nullptr), size(0), pos(0), header_len(0), is_p3(false), out_len(0),
+      is_in_number(false), number_start(0), number(0), is_mismatched(false), is_reported(false), is_at_outb(false),
+      mismatch_offset(0)
+{
+}
+
+OutputChecker::~OutputChecker()
+{
+    if (base)
+        munmap(const_cast<uint8_t *>(base), size);
+}
+
+static bool is_digit(uint8_t c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool is_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// "P3" or "P6", then width, height and maxval, and one whitespace byte
+static size_t ppm_header_len(const uint8_t *p, size_t size)
+{
+    if (size < 2 || p[0] != 'P' || (p[1] != '3' && p[1] != '6'))
+        return 0;
+    size_t i = 2;
+    for (int field = 0; field < 3; field++) {
+        while (i < size && (is_space(p[i]) || p[i] == '#')) {
+            if (p[i] == '#') {
+                while (i < size && p[i] != '\n')
+                    i++;
+            } else
+                i++;
+        }
+        if (i == size || !is_digit(p[i]))
+            return 0;
+        while (i < size && is_digit(p[i]))
+            i++;
+    }
+    return i < size && is_space(p[i]) ? i + 1 : 0;
+}
+
+bool OutputChecker::open(const string &name)
+{
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        base = static_cast<const uint8_t *>(p);
+        madvise(p, size, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+
+    if (tolerance > 0) {
+        header_len = ppm_header_len(base, size);
+        is_p3 = header_len > 0 && base[1] == '3';
+    }
+    return true;
+}
+
+static string describe(uint8_t c)
+{
+    ostringstream ss;
+    if (c >= 0x20 && c < 0x7f)
+        ss << "'" << c << "'";
+    else
+        ss << "0x" << hex << setw(2) << setfill('0') << (int)c;
+    return ss.str();
+}
+
+void OutputChecker::set_mismatch(uint64_t offset, const string &expected, const string &actual)
+{
+    is_mismatched = true;
+    mismatch_offset = offset;
+    mismatch_expected = expected;
+    mismatch_actual = actual;
+    sim->get_cpu()->raise_exception();
+}
+
+// once the CPU has stopped, so the outb that differed is the last
+// instruction retired
+void OutputChecker::report()
+{
+    if (!is_mismatched || is_reported)
+        return;
+    is_reported = true;
+    CPU *cpu = sim->get_cpu();
+    ostream &log = sim->log();
+    log << "Output mismatch at byte " << mismatch_offset << " after " << cpu->get_clocks() << " clocks: expected "
+        << mismatch_expected << ", got " << mismatch_actual << "." << endl;
+    if (is_at_outb)
+        sim->print_line(cpu->get_prev_pc());
+    log << endl;
+}
+
+bool OutputChecker::compare_number()
+{
+    is_in_number = false;
+    if (pos == size || !is_digit(base[pos])) {
+        set_mismatch(number_start, pos == size ? "end of file" : describe(base[pos]), to_string(number));
+        return false;
+    }
+    size_t start = pos;
+    uint32_t expected = 0;
+    for (; pos < size && is_digit(base[pos]); pos++)
+        expected = min(expected * 10 + (base[pos] - '0'), EXPECT_NUMBER_MAX);
+    if ((number > expected ? number - expected : expected - number) > tolerance) {
+        pos = start;
+        set_mismatch(number_start, to_string(expected), to_string(number));
+        return false;
+    }
+    return true;
+}
+
+void OutputChecker::write(const char *buf, size_t len)
+{
+    is_at_outb = true;
+    for (size_t i = 0; i < len && !is_mismatched; i++) {
+        uint8_t c = buf[i];
+        uint64_t offset = out_len++;
+        if (header_len > 0 && offset >= header_len) { // PPM pixel values
+            if (is_p3 && is_digit(c)) {
+                if (!is_in_number) {
+                    is_in_number = true;
+                    number_start = offset;
+                    number = 0;
+                }
+                number = min(number * 10 + (c - '0'), EXPECT_NUMBER_MAX);
+                continue;
+            }
+            if (is_p3 && is_in_number && !compare_number())
+                break;
+            if (!is_p3) {
+                if (pos == size || (c > base[pos] ? c - base[pos] : base[pos] - c) > (int)tolerance)
+                    set_mismatch(offset, pos == size ? "end of file" : describe(base[pos]), describe(c));
+                else
+                    pos++;
+                continue;
+            }
+        }
+        if (pos == size || base[pos] != c)
+            set_mismatch(offset, pos == size ? "end of file" : describe(base[pos]), describe(c));
+        else
+            pos++;
+    }
+}
+
+bool OutputChecker::is_passed()
+{
+    if (is_in_number && !is_mismatched) { // the output ends inside the value
+        is_at_outb = false;
+        compare_number();
+    }
+    report();
+    return !is_mismatched && pos == size;
+}
+
+void OutputChecker::print()
+{
+    bool is_ok = is_passed();
+    ostream &log = sim->log();
+    log << endl << "[Expected output]" << endl;
+    log << pos << " of " << size << " bytes matched";
+    if (tolerance > 0)
+        log << " (tolerance " << tolerance << (header_len > 0 ? "" : ", not a PPM file") << ")";
+    log << "." << endl;
+    if (!is_ok && !is_mismatched)
+        log << "The output ended first." << endl;
+}
@@ -0,0 +1,82 @@
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "common.h"
+
+GuestIO::GuestIO() : in_pos(0), out_fd(STDOUT_FILENO), sink(nullptr), checker(nullptr), out_flushed(0), out_len(0)
+{
+    out_buf = new char[OUT_BUF_SIZE];
+}
+
+GuestIO::~GuestIO()
+{
+    flush();
+    if (out_fd != STDOUT_FILENO && out_fd >= 0)
+        close(out_fd);
+    delete[] out_buf;
+}
+
+// the whole input is read up front; inb only moves a cursor
+bool GuestIO::open_input(const string &name)
+{
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    in_buf.clear();
+    in_pos = 0;
+    char chunk[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+        in_buf.insert(in_buf.end(), chunk, chunk + n);
+    close(fd);
+    return n == 0;
+}
+
+bool GuestIO::open_output(const string &name)
+{
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    flush();
+    if (out_fd != STDOUT_FILENO && out_fd >= 0)
+        close(out_fd);
+    out_fd = fd;
+    return true;
+}
+
+void GuestIO::capture_output(OutputSink *sink)
+{
+    flush();
+    if (out_fd != STDOUT_FILENO && out_fd >= 0)
+        close(out_fd);
+    out_fd = -1;
+    captured.clear();
+    this->sink = sink;
+}
+
+void GuestIO::flush()
+{
+    out_flushed += out_len;
+    if (out_fd < 0) {
+        if (sink && out_len > 0)
+            sink->write(out_buf, out_len);
+        else if (!sink)
+            captured.append(out_buf, out_len);
+        out_len = 0;
+        return;
+    }
+    size_t done = 0;
+    while (done < out_len) {
+        ssize_t n = write(out_fd, out_buf + done, out_len - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    out_len = 0;
+}
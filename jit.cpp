@@ -0,0 +1,694 @@
+#include <cstring>
+#include <csignal>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+using namespace std;
+
+#include "common.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// Template JIT for x86-64. Every basic block is compiled to host code that
+// works directly on the CPU object: guest registers, pc and prev_pc are
+// addressed relative to it, so the state is always the one print_state and
+// the interpreters see. inb/outb/halt, invalid words and unaligned or out of
+// range PCs are never compiled; the dispatcher runs them with step_exec.
+// With guard-page memory (-guard-mem) loads and stores are not bounds
+// checked: a SIGSEGV in the guard region is redirected to the side exit of
+// the faulting instruction, which then reports itself through step_exec.
+//
+// Register assignment inside generated code:
+//   rdi = CPU *, rsi = JitContext *, r8 = guest memory,
+//   r9 = block counters, r10 = entry table
+//   eax, ecx, edx, xmm0 = scratch
+
+namespace {
+
+enum Reg { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9, R10 = 10, R11 = 11 };
+enum Cond { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_P = 0xa, CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd };
+enum ExitReason : uint32_t { EXIT_NONE, EXIT_SIDE, EXIT_BUDGET };
+
+const size_t CODE_SIZE = 64 << 20;
+
+struct JitContext
+{
+    uint64_t budget; // clocks left before max_clocks
+    uint32_t reason; // ExitReason
+    uint32_t block, partial; // side exit: block start index and retired instructions
+};
+
+}
+
+class Jit
+{
+public:
+    // d_* are the byte offsets of the CPU fields from the CPU object
+    Jit(const vector<DecodedInst> &dinsts, uint32_t mem_size, bool is_guard,
+        int32_t d_r, int32_t d_f, int32_t d_pc, int32_t d_prev_pc);
+    ~Jit();
+
+    bool is_ok() { return buf != nullptr; }
+    bool is_full() { return is_overflown; } // a block did not fit; reset and retry
+    void reset();
+    // host code for the block starting at idx, compiled on demand;
+    // nullptr if the instruction there must be interpreted or is_full()
+    void *entry_of(uint32_t idx);
+    void enter(void *cpu, uint32_t *mem, void *entry);
+    // side exit for a faulting host instruction, or 0
+    uintptr_t stub_of_fault(uintptr_t host_pc);
+
+    JitContext ctx;
+    vector<uint64_t> counts; // executions of the block starting at each index
+    vector<uint32_t> block_len; // 0 if no block is compiled there
+    vector<uint32_t> compiled;
+
+private:
+    const vector<DecodedInst> &dinsts;
+    vector<bool> is_leader;
+    vector<void *> entry;
+    uint32_t text_len, mem_size;
+    bool is_guard;
+    int32_t d_r, d_f, d_pc, d_prev_pc;
+    uint8_t *buf, *ret_stub;
+    void (*trampoline)(void *cpu, JitContext *ctx, uint32_t *mem, uint64_t *counts, void **entry, void *target);
+    size_t used; // may pass CODE_SIZE while a block is emitted, then nothing is written
+    bool is_overflown;
+
+    struct SideExit { size_t rel; uint32_t k; };
+    vector<SideExit> side_exits, fault_sites; // rel: jcc to patch / faulting instruction
+    vector<pair<uintptr_t, uintptr_t>> fault_stubs; // host pc of loads/stores -> side exit, sorted
+    uint32_t cur_start, cur_len;
+
+    // raw emission
+    void byte(uint8_t b)
+    {
+        if (used < CODE_SIZE)
+            buf[used] = b;
+        used++;
+    }
+    void dword(uint32_t d)
+    {
+        if (used + 4 <= CODE_SIZE)
+            memcpy(buf + used, &d, 4);
+        used += 4;
+    }
+    void rex(bool w, int reg, int index, int base);
+    void op_mem(uint8_t prefix, const vector<uint8_t> &opc, int reg, int base, int32_t disp, bool w = false);
+    void op_rr(uint8_t prefix, const vector<uint8_t> &opc, int reg, int rm, bool w = false);
+    void op_sib(const vector<uint8_t> &opc, int reg, int base, int index, int scale, bool w = false);
+    size_t jcc(Cond cc);
+    size_t jmp();
+    void patch(size_t rel, size_t target);
+    void patch_to(size_t rel, const uint8_t *target);
+
+    // guest state
+    int32_t r_disp(uint32_t i) { return d_r + 4 * i; }
+    int32_t f_disp(uint32_t i) { return d_f + 4 * i; }
+    void load_r(int reg, uint32_t i) { op_mem(0, {0x8b}, reg, RDI, r_disp(i)); }
+    void store_r(uint32_t i, int reg) { if (i != 0) op_mem(0, {0x89}, reg, RDI, r_disp(i)); }
+    void store_f_bits(uint32_t i, int reg) { op_mem(0, {0x89}, reg, RDI, f_disp(i)); }
+    void mov_mem_imm(int base, int32_t disp, uint32_t imm);
+    void side_exit(Cond cc, uint32_t k);
+    void nan_bits_check(int reg, uint32_t k);
+    void goto_static(uint32_t target, uint32_t from_pc);
+    void goto_dynamic(uint32_t from_pc);
+
+    void compile_inst(const DecodedInst &inst, uint32_t k);
+    void *compile_block(uint32_t idx);
+};
+
+Jit::Jit(const vector<DecodedInst> &dinsts, uint32_t mem_size, bool is_guard,
+         int32_t d_r, int32_t d_f, int32_t d_pc, int32_t d_prev_pc)
+    : dinsts(dinsts), text_len(dinsts.size()), mem_size(mem_size), is_guard(is_guard),
+      d_r(d_r), d_f(d_f), d_pc(d_pc), d_prev_pc(d_prev_pc), used(0), is_overflown(false)
+{
+    void *p = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf = p == MAP_FAILED ? nullptr : static_cast<uint8_t *>(p);
+    is_leader = find_leaders(dinsts);
+    counts.assign(text_len, 0);
+    block_len.assign(text_len, 0);
+    entry.assign(text_len, nullptr);
+
+    if (buf)
+        reset();
+}
+
+Jit::~Jit()
+{
+    if (buf)
+        munmap(buf, CODE_SIZE);
+}
+
+// drops every compiled block; counters must have been flushed
+void Jit::reset()
+{
+    used = 0;
+    is_overflown = false;
+
+    ret_stub = buf + used;
+    byte(0xc3); // ret
+
+    // trampoline(cpu, ctx, mem, counts, entry, target)
+    //   rdi, rsi, rdx, rcx, r8, r9
+    trampoline = reinterpret_cast<decltype(trampoline)>(buf + used);
+    op_rr(0, {0x89}, R8, R10, true); // mov r10, r8
+    op_rr(0, {0x89}, R9, R11, true); // mov r11, r9
+    op_rr(0, {0x89}, RDX, R8, true); // mov r8, rdx
+    op_rr(0, {0x89}, RCX, R9, true); // mov r9, rcx
+    op_rr(0, {0xff}, 4, R11); // jmp r11
+
+    for (uint32_t i : compiled)
+        block_len[i] = 0;
+    compiled.clear();
+    fault_stubs.clear();
+    fill(entry.begin(), entry.end(), ret_stub);
+}
+
+void Jit::enter(void *cpu, uint32_t *mem, void *target)
+{
+    trampoline(cpu, &ctx, mem, counts.data(), entry.data(), target);
+}
+
+uintptr_t Jit::stub_of_fault(uintptr_t host_pc)
+{
+    auto it = lower_bound(fault_stubs.begin(), fault_stubs.end(), make_pair(host_pc, (uintptr_t)0));
+    return it != fault_stubs.end() && it->first == host_pc ? it->second : 0;
+}
+
+void *Jit::entry_of(uint32_t idx)
+{
+    if (block_len[idx] > 0)
+        return entry[idx];
+    switch (dinsts[idx].type) {
+        case InstType::inb:
+        case InstType::outb:
+        case InstType::halt:
+        case InstType::sentinel:
+            return nullptr;
+        default:
+            return compile_block(idx);
+    }
+}
+
+void Jit::rex(bool w, int reg, int index, int base)
+{
+    uint8_t b = 0x40 | (w << 3) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((base >> 3) & 1);
+    if (b != 0x40)
+        byte(b);
+}
+
+// op reg, [base + disp32]
+void Jit::op_mem(uint8_t prefix, const vector<uint8_t> &opc, int reg, int base, int32_t disp, bool w)
+{
+    if (prefix)
+        byte(prefix);
+    rex(w, reg, 0, base);
+    for (uint8_t b : opc)
+        byte(b);
+    byte(0x80 | (reg & 7) << 3 | (base & 7));
+    dword(disp);
+}
+
+// op rm, reg (register direct)
+void Jit::op_rr(uint8_t prefix, const vector<uint8_t> &opc, int reg, int rm, bool w)
+{
+    if (prefix)
+        byte(prefix);
+    rex(w, reg, 0, rm);
+    for (uint8_t b : opc)
+        byte(b);
+    byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + index * 2^scale]
+void Jit::op_sib(const vector<uint8_t> &opc, int reg, int base, int index, int scale, bool w)
+{
+    rex(w, reg, index, base);
+    for (uint8_t b : opc)
+        byte(b);
+    byte((reg & 7) << 3 | 0b100);
+    byte(scale << 6 | (index & 7) << 3 | (base & 7));
+}
+
+size_t Jit::jcc(Cond cc)
+{
+    byte(0x0f);
+    byte(0x80 | cc);
+    dword(0);
+    return used - 4;
+}
+
+size_t Jit::jmp()
+{
+    byte(0xe9);
+    dword(0);
+    return used - 4;
+}
+
+void Jit::patch(size_t rel, size_t target)
+{
+    int32_t d = (int32_t)(target - (rel + 4));
+    if (rel + 4 <= CODE_SIZE)
+        memcpy(buf + rel, &d, 4);
+}
+
+void Jit::patch_to(size_t rel, const uint8_t *target)
+{
+    patch(rel, target - buf);
+}
+
+void Jit::mov_mem_imm(int base, int32_t disp, uint32_t imm)
+{
+    op_mem(0, {0xc7}, 0, base, disp);
+    dword(imm);
+}
+
+void Jit::side_exit(Cond cc, uint32_t k)
+{
+    side_exits.push_back({jcc(cc), k});
+}
+
+// NaN iff (bits & 0x7fffffff) > 0x7f800000
+void Jit::nan_bits_check(int reg, uint32_t k)
+{
+    op_rr(0, {0x89}, reg, RDX); // mov edx, reg
+    op_rr(0, {0x81}, 4, RDX); // and edx, imm32
+    dword(0x7fffffff);
+    op_rr(0, {0x81}, 7, RDX); // cmp edx, imm32
+    dword(0x7f800000);
+    side_exit(CC_A, k);
+}
+
+void Jit::goto_static(uint32_t target, uint32_t from_pc)
+{
+    mov_mem_imm(RDI, d_prev_pc, from_pc);
+    mov_mem_imm(RDI, d_pc, target);
+    if ((target & 0b11) == 0 && (target >> 2) < text_len)
+        op_mem(0, {0xff}, 4, R10, (target >> 2) * 8); // jmp [r10 + idx * 8]
+    else
+        byte(0xc3); // ret; the dispatcher reports or interprets it
+}
+
+// target in eax
+void Jit::goto_dynamic(uint32_t from_pc)
+{
+    mov_mem_imm(RDI, d_prev_pc, from_pc);
+    op_mem(0, {0x89}, RAX, RDI, d_pc); // mov [pc], eax
+    byte(0xa9); // test eax, 3
+    dword(0b11);
+    patch_to(jcc(CC_NE), ret_stub);
+    op_rr(0, {0x89}, RAX, RCX); // mov ecx, eax
+    op_rr(0, {0xc1}, 5, RCX); // shr ecx, 2
+    byte(2);
+    op_rr(0, {0x81}, 7, RCX); // cmp ecx, text_len
+    dword(text_len);
+    patch_to(jcc(CC_AE), ret_stub);
+    op_sib({0xff}, 4, R10, RCX, 3); // jmp [r10 + rcx * 8]
+}
+
+void Jit::compile_inst(const DecodedInst &d, uint32_t k)
+{
+    uint32_t pc = (cur_start + k) << 2;
+    uint32_t rd = d.rd, rs1 = d.rs1, rs2 = d.rs2;
+
+    switch (d.type) {
+        // R type
+        case InstType::add:
+        case InstType::sub:
+        case InstType::or_: {
+            uint8_t opc = d.type == InstType::add ? 0x03 : d.type == InstType::sub ? 0x2b : 0x0b;
+            load_r(RAX, rs1);
+            op_mem(0, {opc}, RAX, RDI, r_disp(rs2));
+            store_r(rd, RAX);
+            break;
+        }
+        case InstType::fadd:
+        case InstType::fsub:
+        case InstType::fmul:
+        case InstType::fdiv: {
+            uint8_t opc = d.type == InstType::fadd ? 0x58 : d.type == InstType::fsub ? 0x5c : d.type == InstType::fmul ? 0x59 : 0x5e;
+            op_mem(0xf3, {0x0f, 0x10}, 0, RDI, f_disp(rs1)); // movss xmm0, [f rs1]
+            op_mem(0xf3, {0x0f, opc}, 0, RDI, f_disp(rs2));
+            op_rr(0, {0x0f, 0x2e}, 0, 0); // ucomiss xmm0, xmm0
+            side_exit(CC_P, k);
+            op_mem(0xf3, {0x0f, 0x11}, 0, RDI, f_disp(rd));
+            break;
+        }
+        case InstType::fsqrt:
+            op_mem(0xf3, {0x0f, 0x51}, 0, RDI, f_disp(rs1)); // sqrtss xmm0, [f rs1]
+            op_rr(0, {0x0f, 0x2e}, 0, 0);
+            side_exit(CC_P, k);
+            op_mem(0xf3, {0x0f, 0x11}, 0, RDI, f_disp(rd));
+            break;
+        case InstType::fsgnj:
+        case InstType::fsgnjn:
+        case InstType::fsgnjx:
+            op_mem(0, {0x8b}, RAX, RDI, f_disp(rs1));
+            op_mem(0, {0x8b}, RCX, RDI, f_disp(rs2));
+            if (d.type == InstType::fsgnjn)
+                op_rr(0, {0xf7}, 2, RCX); // not ecx
+            op_rr(0, {0x81}, 4, RCX); // and ecx, 0x80000000
+            dword(0x80000000);
+            if (d.type != InstType::fsgnjx) {
+                op_rr(0, {0x81}, 4, RAX); // and eax, 0x7fffffff
+                dword(0x7fffffff);
+                op_rr(0, {0x09}, RCX, RAX); // or eax, ecx
+            } else
+                op_rr(0, {0x31}, RCX, RAX); // xor eax, ecx
+            nan_bits_check(RAX, k);
+            store_f_bits(rd, RAX);
+            break;
+        case InstType::feq:
+            op_mem(0xf3, {0x0f, 0x10}, 0, RDI, f_disp(rs1));
+            op_mem(0, {0x0f, 0x2e}, 0, RDI, f_disp(rs2)); // ucomiss xmm0, [f rs2]
+            op_rr(0, {0x0f, 0x94}, 0, RAX); // sete al
+            op_rr(0, {0x0f, 0x9b}, 0, RCX); // setnp cl
+            op_rr(0, {0x20}, RCX, RAX); // and al, cl
+            op_rr(0, {0x0f, 0xb6}, RAX, RAX); // movzx eax, al
+            store_r(rd, RAX);
+            break;
+        case InstType::fle:
+            op_mem(0xf3, {0x0f, 0x10}, 0, RDI, f_disp(rs2));
+            op_mem(0, {0x0f, 0x2e}, 0, RDI, f_disp(rs1)); // ucomiss xmm0 (rs2), [f rs1]
+            op_rr(0, {0x0f, 0x93}, 0, RAX); // setae al
+            op_rr(0, {0x0f, 0xb6}, RAX, RAX);
+            store_r(rd, RAX);
+            break;
+        case InstType::fcvt_w_s:
+            op_mem(0xf3, {0x0f, 0x2d}, RAX, RDI, f_disp(rs1)); // cvtss2si eax, [f rs1] (round to nearest even)
+            store_r(rd, RAX);
+            break;
+        case InstType::fcvt_s_w:
+            op_mem(0xf3, {0x0f, 0x2a}, 0, RDI, r_disp(rs1)); // cvtsi2ss xmm0, [r rs1]
+            op_mem(0xf3, {0x0f, 0x11}, 0, RDI, f_disp(rd));
+            break;
+        case InstType::fmv_s_x:
+            load_r(RAX, rs1);
+            nan_bits_check(RAX, k);
+            store_f_bits(rd, RAX);
+            break;
+        // I type
+        case InstType::addi:
+            load_r(RAX, rs1);
+            op_rr(0, {0x81}, 0, RAX); // add eax, imm
+            dword(d.imm);
+            store_r(rd, RAX);
+            break;
+        case InstType::slli:
+        case InstType::srai:
+            load_r(RAX, rs1);
+            op_rr(0, {0xc1}, d.type == InstType::slli ? 4 : 7, RAX); // shl/sar eax, imm8
+            byte(d.imm);
+            store_r(rd, RAX);
+            break;
+        case InstType::lw:
+        case InstType::flw:
+        case InstType::sw:
+        case InstType::fsw: {
+            load_r(RAX, rs1);
+            op_rr(0, {0x81}, 0, RAX); // add eax, imm
+            dword(d.imm);
+            op_rr(0, {0xc1}, 5, RAX); // shr eax, 2
+            byte(2);
+            if (is_guard) { // the access below may fault instead
+                if (d.type == InstType::sw || d.type == InstType::fsw)
+                    op_mem(0, {0x8b}, RCX, RDI, d.type == InstType::sw ? r_disp(rs2) : f_disp(rs2));
+                fault_sites.push_back({used, k});
+            } else {
+                op_rr(0, {0x81}, 7, RAX); // cmp eax, mem_size
+                dword(mem_size);
+                side_exit(CC_AE, k);
+                if (d.type == InstType::sw || d.type == InstType::fsw)
+                    op_mem(0, {0x8b}, RCX, RDI, d.type == InstType::sw ? r_disp(rs2) : f_disp(rs2));
+            }
+            if (d.type == InstType::lw) {
+                op_sib({0x8b}, RCX, R8, RAX, 2); // mov ecx, [r8 + rax * 4]
+                store_r(rd, RCX);
+            } else if (d.type == InstType::flw) {
+                op_sib({0x8b}, RCX, R8, RAX, 2);
+                nan_bits_check(RCX, k);
+                store_f_bits(rd, RCX);
+            } else
+                op_sib({0x89}, RCX, R8, RAX, 2); // mov [r8 + rax * 4], ecx
+            break;
+        }
+        case InstType::jalr:
+            if (rd != 0)
+                mov_mem_imm(RDI, r_disp(rd), pc + WORD_SIZE);
+            load_r(RAX, rs1); // after the link, as CPU::jalr does
+            op_rr(0, {0x81}, 0, RAX);
+            dword(d.imm);
+            goto_dynamic(pc);
+            break;
+        // SB type
+        case InstType::beq:
+        case InstType::bne:
+        case InstType::blt:
+        case InstType::bge: {
+            Cond cc = d.type == InstType::beq ? CC_E : d.type == InstType::bne ? CC_NE : d.type == InstType::blt ? CC_L : CC_GE;
+            load_r(RAX, rs1);
+            op_mem(0, {0x3b}, RAX, RDI, r_disp(rs2)); // cmp eax, [r rs2]
+            size_t taken = jcc(cc);
+            goto_static(pc + WORD_SIZE, pc);
+            patch(taken, used);
+            goto_static(pc + d.imm, pc);
+            break;
+        }
+        // U type
+        case InstType::lui:
+            if (rd != 0) {
+                load_r(RAX, rd);
+                op_rr(0, {0x81}, 4, RAX); // and eax, 0xfff
+                dword(0x00000fff);
+                op_rr(0, {0x81}, 1, RAX); // or eax, imm
+                dword(d.imm);
+                store_r(rd, RAX);
+            }
+            break;
+        // UJ type
+        case InstType::jal:
+            if (rd != 0)
+                mov_mem_imm(RDI, r_disp(rd), pc + WORD_SIZE);
+            goto_static(pc + d.imm, pc);
+            break;
+        default: // not compiled
+            break;
+    }
+}
+
+void *Jit::compile_block(uint32_t idx)
+{
+    cur_start = idx;
+    cur_len = 0;
+    bool is_terminated = false;
+    for (uint32_t i = idx; i < text_len; i++) {
+        InstType t = dinsts[i].type;
+        if (t == InstType::inb || t == InstType::outb || t == InstType::halt || t == InstType::sentinel)
+            break;
+        cur_len++;
+        if (is_block_end(t)) {
+            is_terminated = true;
+            break;
+        }
+        if (i + 1 < text_len && is_leader[i + 1])
+            break;
+    }
+
+    size_t start = used;
+    is_overflown = false;
+    side_exits.clear();
+    fault_sites.clear();
+
+    // sub qword [rsi + budget], len; jb budget_exit
+    op_mem(0, {0x81}, 5, RSI, offsetof(JitContext, budget), true);
+    dword(cur_len);
+    size_t budget_exit = jcc(CC_B);
+    // inc qword [r9 + idx * 8]
+    op_mem(0, {0xff}, 0, R9, idx * 8, true);
+
+    for (uint32_t k = 0; k < cur_len; k++)
+        compile_inst(dinsts[idx + k], k);
+    if (!is_terminated) {
+        uint32_t last_pc = (idx + cur_len - 1) << 2;
+        goto_static(last_pc + WORD_SIZE, last_pc);
+    }
+
+    patch(budget_exit, used);
+    op_mem(0, {0x81}, 0, RSI, offsetof(JitContext, budget), true); // add back
+    dword(cur_len);
+    mov_mem_imm(RSI, offsetof(JitContext, reason), EXIT_BUDGET);
+    byte(0xc3);
+
+    // one exit stub per instruction that needs one
+    vector<size_t> stub_at(cur_len, SIZE_MAX);
+    for (const SideExit &e : side_exits)
+        stub_at[e.k] = 0;
+    for (const SideExit &e : fault_sites)
+        stub_at[e.k] = 0;
+    for (uint32_t k = 0; k < cur_len; k++) {
+        if (stub_at[k] == SIZE_MAX)
+            continue;
+        stub_at[k] = used;
+        op_mem(0, {0x81}, 0, RSI, offsetof(JitContext, budget), true);
+        dword(cur_len - k);
+        op_mem(0, {0xff}, 1, R9, idx * 8, true); // dec qword [r9 + idx * 8]
+        mov_mem_imm(RSI, offsetof(JitContext, reason), EXIT_SIDE);
+        mov_mem_imm(RSI, offsetof(JitContext, block), idx);
+        mov_mem_imm(RSI, offsetof(JitContext, partial), k);
+        mov_mem_imm(RDI, d_pc, (idx + k) << 2);
+        if (k > 0)
+            mov_mem_imm(RDI, d_prev_pc, (idx + k - 1) << 2);
+        byte(0xc3);
+    }
+    if (used > CODE_SIZE) { // dropped; the caller resets the buffer
+        used = start;
+        is_overflown = true;
+        return nullptr;
+    }
+    for (const SideExit &e : side_exits)
+        patch(e.rel, stub_at[e.k]);
+    for (const SideExit &e : fault_sites)
+        fault_stubs.push_back({(uintptr_t)(buf + e.rel), (uintptr_t)(buf + stub_at[e.k])});
+
+    entry[idx] = buf + start;
+    block_len[idx] = cur_len;
+    compiled.push_back(idx);
+    return buf + start;
+}
+
+// the JIT running generated code, for the SIGSEGV handler
+static thread_local Jit *running_jit; // per thread for concurrent CPUs (-batch)
+static thread_local GuestMemory *running_mem;
+
+static void handle_guard_fault(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = static_cast<ucontext_t *>(context);
+    uintptr_t stub = 0;
+    if (running_jit && running_mem->is_guard_addr(info->si_addr))
+        stub = running_jit->stub_of_fault(uc->uc_mcontext.gregs[REG_RIP]);
+    if (stub == 0) { // a real crash; let it happen again without us
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+    uc->uc_mcontext.gregs[REG_RIP] = stub;
+}
+
+bool CPU::run_jit(const vector<DecodedInst> &dinsts, uint64_t max_clocks)
+{
+    const RunLoop fallback = threaded_loop(FEAT_MAX | FEAT_COUNT | FEAT_NAN);
+    if (show_max_f) // needs a look at every instruction
+        return (this->*fallback)(dinsts, max_clocks);
+
+    if (!jit) {
+        jit = new Jit(dinsts, mem_size, mem.is_guarded(), (char *)r - (char *)this, (char *)f - (char *)this,
+                      (char *)&pc - (char *)this, (char *)&prev_pc - (char *)this);
+        if (!jit->is_ok())
+            report_warning("cannot allocate executable memory; falling back to the interpreter", log());
+        if (jit->is_ok() && mem.is_guarded()) {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_sigaction = handle_guard_fault;
+            sa.sa_flags = SA_SIGINFO;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGSEGV, &sa, nullptr);
+        }
+    }
+    if (!jit->is_ok())
+        return (this->*fallback)(dinsts, max_clocks);
+
+    const uint32_t text_len = dinsts.size();
+    JitContext &ctx = jit->ctx;
+    ctx.budget = clocks < max_clocks ? max_clocks - clocks : 0;
+    bool res = true;
+
+    while (res && !halted_f && !exception_f && ctx.budget > 0) {
+        uint32_t idx = pc >> 2;
+        void *entry = nullptr;
+        if ((pc & 0b11) == 0 && idx < text_len) {
+            entry = jit->entry_of(idx);
+            if (jit->is_full()) { // a block too long for an empty buffer is interpreted
+                flush_jit_counters(dinsts);
+                jit->reset();
+                entry = jit->entry_of(idx);
+            }
+        }
+        if (!entry) {
+            res = step_exec(this, dinsts);
+            ctx.budget--;
+            continue;
+        }
+
+        ctx.reason = EXIT_NONE;
+        running_jit = jit;
+        running_mem = &mem;
+        jit->enter(this, mem.data(), entry);
+        running_jit = nullptr;
+
+        if (ctx.reason == EXIT_SIDE) {
+            // retired part of the block, then the faulting instruction reports itself
+            for (uint32_t i = ctx.block; i < ctx.block + ctx.partial; i++) {
+                exec_count[i]++;
+            }
+            clocks += ctx.partial;
+            res = step_exec(this, dinsts);
+            ctx.budget--;
+        } else if (ctx.reason == EXIT_BUDGET) {
+            for (; ctx.budget > 0 && res && !halted_f && !exception_f; ctx.budget--)
+                res = step_exec(this, dinsts);
+        }
+    }
+
+    flush_jit_counters(dinsts);
+    return res;
+}
+
+void CPU::flush_jit_counters(const vector<DecodedInst> &dinsts)
+{
+    for (uint32_t start : jit->compiled) {
+        uint64_t count = jit->counts[start];
+        if (count == 0)
+            continue;
+        uint32_t len = jit->block_len[start];
+        for (uint32_t i = start; i < start + len; i++) {
+            exec_count[i] += count;
+        }
+        clocks += count * len;
+        jit->counts[start] = 0;
+    }
+}
+
+void CPU::release_jit()
+{
+    delete jit;
+    jit = nullptr;
+}
+
+#else // !(__x86_64__ && __linux__)
+
+class Jit
+{
+};
+
+bool CPU::run_jit(const vector<DecodedInst> &dinsts, uint64_t max_clocks)
+{
+    return (this->*threaded_loop(FEAT_MAX | FEAT_COUNT | FEAT_NAN))(dinsts, max_clocks);
+}
+
+void CPU::flush_jit_counters(const vector<DecodedInst> &dinsts)
+{
+}
+
+void CPU::release_jit()
+{
+    delete jit;
+    jit = nullptr;
+}
+
+#endif
@@ -5,41 +5,23 @@
 #include <set>
 #include <cstdint>
 #include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
 
 using namespace std;
 
 #include "common.h"
 
-const uint32_t WORD_SIZE = 4;
-const uint32_t MEM_SIZE = 0x1000000; // 64 MiB
+const uint64_t DEFAULT_MISS_PENALTY = 10;
+const size_t DEFAULT_BPRED_WORST = 10;
+const size_t DEFAULT_UNDO_SIZE = 1 << 20; // 12 MiB
 
-ifstream zoi_file, in_file;
-bool is_show_max = false;
-
-vector<uint32_t> insts, data;
-vector<uint32_t> inst_lines;
-vector<string> lines, labels;
-map<string, uint32_t> label_lnum_map;
-
-vector<bool> is_unreached_index;
-
-CPU *cpu;
-
-uint32_t read_word()
+bool report_stop(Simulator *sim, bool res, bool is_show_halted)
 {
-    uint8_t bs[WORD_SIZE];
-    zoi_file.read(reinterpret_cast<char *>(bs), WORD_SIZE);
-    return (uint32_t)bs[0] | ((uint32_t)bs[1]) << 8 | ((uint32_t)bs[2]) << 16 | ((uint32_t)bs[3]) << 24;
-}
-
-uint32_t lnum_of_label(string label)
-{
-    return label_lnum_map.at(label);
-}
-
-bool step_and_report(bool is_show_halted)
-{
-    bool res = step_exec(cpu, insts);
+    CPU *cpu = sim->get_cpu();
+    if (!res || cpu->is_exception() || cpu->is_halted())
+        sim->io().flush();
     if (!res || cpu->is_exception()) {
         cerr << "Execution interrupted." << endl;
         cpu->print_state();
@@ -54,13 +36,29 @@ bool step_and_report(bool is_show_halted)
     return true;
 }
 
-void show_unreached_lines()
+bool step_and_report(Simulator *sim, bool is_show_halted)
+{
+    return report_stop(sim, sim->step(), is_show_halted);
+}
+
+bool run_and_report(Simulator *sim, bool is_show_halted, uint64_t max_clocks)
+{
+    return report_stop(sim, sim->run(max_clocks), is_show_halted);
+}
+
+// runs until a breakpoint or max_clocks (debug mode)
+bool continue_and_report(Simulator *sim, bool is_show_halted, uint64_t max_clocks)
+{
+    return report_stop(sim, sim->run_to_breakpoint(max_clocks), is_show_halted);
+}
+
+void show_unreached_lines(Simulator *sim)
 {
     cerr << endl << "[Unreached Lines]" << endl;
 
     vector<uint32_t> unreached_addrs;
-    for (uint32_t i = 0; i < is_unreached_index.size(); i++) {
-        if (is_unreached_index[i])
+    for (uint32_t i = 0; i < sim->insts().size(); i++) {
+        if (sim->get_cpu()->get_exec_count(i) == 0)
             unreached_addrs.push_back(i << 2);
     }
 
@@ -71,17 +69,17 @@ void show_unreached_lines()
     cerr << " unreached lines." << endl << endl;
 
     for (uint32_t addr : unreached_addrs) {
-        print_line_of_text_addr(addr);
+        sim->print_line(addr);
     }
 }
 
-void show_unreached_labels()
+void show_unreached_labels(Simulator *sim)
 {
     cerr << endl << "[Unreached Labels]" << endl;
 
     vector<string> unreached_labels;
-    for (string label : labels) {
-        if (is_unreached_index[text_addr_of_lnum(lnum_of_label(label)) >> 2])
+    for (const string &label : sim->image().labels()) {
+        if (sim->get_cpu()->get_exec_count(sim->text_addr_of_lnum(sim->lnum_of_label(label)) >> 2) == 0)
             unreached_labels.push_back(label);
     }
 
@@ -97,18 +95,44 @@ void show_unreached_labels()
 
 int main(int argc, char **argv)
 {
+    const set<string> options_with_arg = {"-output", "-callgraph-out", "-timing", "-cache", "-miss-penalty", "-bpred", "-bpred-worst", "-trace", "-cosim", "-undo-size", "-checkpoint-at", "-restore", "-batch", "-jobs", "-serve", "-expect", "-expect-tolerance", "-max-clocks"};
     vector<string> params;
     set<string> options;
+    map<string, string> option_args;
     for (int i = 1; i < argc; i++) {
-        if (argv[i][0] == '-')
+        if (argv[i][0] == '-') {
             options.insert(argv[i]);
-        else
+            if (options_with_arg.count(argv[i])) {
+                if (i + 1 == argc) {
+                    report_error(string("no argument for ") + argv[i]);
+                    exit(1);
+                }
+                option_args[argv[i]] = argv[i + 1];
+                i++;
+            }
+        } else
             params.push_back(argv[i]);
     }
 
+    unsigned jobs = max(thread::hardware_concurrency(), 1u);
+    if (options.count("-jobs")) {
+        try {
+            jobs = stoul(option_args["-jobs"]);
+        } catch (logic_error &) {
+            jobs = 0;
+        }
+        if (jobs == 0) {
+            report_error("invalid number of jobs");
+            exit(1);
+        }
+    }
+    if (options.count("-serve"))
+        return run_server(option_args["-serve"], jobs);
+
     // params
 
-    if (params.size() < 2) {
+    bool is_batch = options.count("-batch");
+    if (params.size() < (is_batch ? 1 : 2)) {
         if (params.size() == 0)
             report_error("no zoi file");
         else if (params.size() == 1)
@@ -122,23 +146,16 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    zoi_file.open(zoi_name, ios::in | ios::binary);
-    if (zoi_file.fail()) {
-        report_error("no such zoi file");
-        exit(1);
-    }
-    in_file.open(params[1], ios::in | ios::binary);
-    if (in_file.fail()) {
-        report_error("no such input file");
-        zoi_file.close();
-        exit(1);
-    }
-
     // options
 
     bool is_debug_mode = false;
     bool is_silent = false;
+    Engine engine = Engine::threaded;
+    bool is_show_mips = false;
+    bool is_show_max = false;
     bool is_show_last_state = false, is_show_stat = false, is_sort_stat = false, is_show_ulines = false, is_show_ulabels = false;
+    bool is_profile = false;
+    bool is_callgraph = false;
 
     if (options.count("-d"))
         is_debug_mode = true;
@@ -154,6 +171,24 @@ int main(int argc, char **argv)
         is_show_ulines = true;
     if (options.count("-show-ulabels"))
         is_show_ulabels = true;
+    if (options.count("-profile"))
+        is_profile = true;
+    if (options.count("-callgraph"))
+        is_callgraph = true;
+    if (options.count("-threaded")) {
+        engine = Engine::threaded;
+        is_show_mips = true;
+    }
+    if (options.count("-blocks")) {
+        engine = Engine::blocks;
+        is_show_mips = true;
+    }
+    if (options.count("-jit")) {
+        engine = Engine::jit;
+        is_show_mips = true;
+    }
+    if (options.count("-show-mips"))
+        is_show_mips = true;
 
     if (options.count("-silent")) {
         is_silent = true;
@@ -162,6 +197,9 @@ int main(int argc, char **argv)
         is_show_max = false;
         is_show_ulines = false;
         is_show_ulabels = false;
+        is_profile = false;
+        is_callgraph = false;
+        is_show_mips = false;
     }
     if (options.count("-verbose")) {
         is_silent = false;
@@ -172,101 +210,260 @@ int main(int argc, char **argv)
         is_show_ulabels = true;
     }
 
-    bool is_debug_file = false;
-    char magic[4];
-    zoi_file.read(magic, WORD_SIZE);
-    if (magic[0] == 'Z' && magic[1] == 'O' && magic[2] == 'I' && (magic[3] == '!' || magic[3] == '?')) {
-        if (magic[3] == '?')
-            is_debug_file = true;
-    } else {
-        zoi_file.close();
-        report_error("invalid file type");
-        exit(1);
+    Simulator::Options sim_options;
+    sim_options.engine = engine;
+    sim_options.is_show_max = is_show_max;
+    sim_options.is_count = is_show_stat || is_show_ulines || is_show_ulabels || is_profile
+                           || options.count("-watchdog"); // the watchdog finds the looping lines by the counts
+    sim_options.is_guard_mem = options.count("-guard-mem");
+
+    uint64_t max_clocks = UINT64_MAX;
+    if (options.count("-max-clocks")) {
+        try {
+            max_clocks = stoull(option_args["-max-clocks"]);
+        } catch (logic_error &) {
+            report_error("invalid clock budget");
+            exit(1);
+        }
     }
 
-    uint32_t data_len = read_word();
-    if (data_len > MEM_SIZE) {
-        zoi_file.close();
-        report_error("static data is too large");
-        exit(1);
+    if (is_batch) {
+        // the runs share the program and report in one table, with no
+        // monitors, reports or files of their own
+        const set<string> batch_options = {"-batch", "-jobs", "-threaded", "-blocks", "-jit", "-guard-mem",
+                                           "-max-clocks", "-watchdog"};
+        for (const string &option : options) {
+            if (!batch_options.count(option)) {
+                report_error(option + " is not supported with -batch");
+                exit(1);
+            }
+        }
+        return run_batch(option_args["-batch"], zoi_name, sim_options, jobs, max_clocks, options.count("-watchdog"));
     }
-    uint32_t text_len = read_word();
 
-    data = vector<uint32_t>(data_len);
-    for (uint32_t i = 0; i < data_len; i++) {
-        data[i] = read_word();
+    size_t undo_size = 0;
+    if (is_debug_mode) {
+        undo_size = DEFAULT_UNDO_SIZE;
+        if (options.count("-undo-size")) {
+            try {
+                undo_size = stoull(option_args["-undo-size"]);
+            } catch (logic_error &) {
+                report_error("invalid undo log size");
+                exit(1);
+            }
+        }
     }
 
-    is_unreached_index = vector<bool>(text_len, true);
-    insts = vector<uint32_t>(text_len);
-    for (uint32_t i = 0; i < text_len; i++) {
-        insts[i] = read_word();
+    Simulator *sim = new Simulator(sim_options);
+    string load_error;
+    if (!sim->load(zoi_name, load_error)) {
+        report_error(load_error);
+        exit(1);
     }
-
-    if (is_debug_file) {
-        inst_lines = vector<uint32_t>(text_len); // 1-origin
-        for (uint32_t i = 0; i < text_len; i++) {
-            inst_lines[i] = read_word();
+    if (!sim->io().open_input(params[1])) {
+        report_error("no such input file");
+        exit(1);
+    }
+    if (options.count("-output") && !sim->io().open_output(option_args["-output"])) {
+        report_error("cannot open output file");
+        exit(1);
+    }
+    CPU *cpu = sim->get_cpu();
+    if (options.count("-restore")) {
+        string error;
+        if (!sim->restore_checkpoint(option_args["-restore"], error)) {
+            report_error(error);
+            exit(1);
+        }
+    }
+    uint64_t checkpoint_at = UINT64_MAX;
+    if (options.count("-checkpoint-at")) {
+        try {
+            checkpoint_at = stoull(option_args["-checkpoint-at"]);
+        } catch (logic_error &) {
+            report_error("invalid checkpoint clock");
+            exit(1);
         }
+    }
+    string checkpoint_name = zoi_name.substr(0, zoi_name.size() - 4) + ".ckpt";
 
-        string cur_line;
-        uint32_t cur_lnum = 0;
-        while (!zoi_file.eof()) {
-            getline(zoi_file, cur_line);
-            cur_lnum++;
-            lines.push_back(cur_line);
-
-            auto es = split_string(cur_line, " #\t");
-            if (es.size() > 0 && es[0].back() == ':') {
-                string label = es[0].substr(0, es[0].size() - 1);
-                labels.push_back(label);
-                label_lnum_map[label] = cur_lnum;
+    CallGraph *call_graph = nullptr;
+    if (is_callgraph || options.count("-callgraph-out")) {
+        call_graph = new CallGraph(sim);
+        cpu->add_monitor(call_graph);
+    }
+    TimingModel *timing = nullptr;
+    if (options.count("-timing")) {
+        timing = new TimingModel(sim);
+        string error;
+        if (!timing->load_config(option_args["-timing"], error)) {
+            report_error(error);
+            exit(1);
+        }
+        cpu->add_monitor(timing);
+    }
+    CacheSim *cache_sim = nullptr;
+    if (options.count("-cache")) {
+        uint64_t miss_penalty = DEFAULT_MISS_PENALTY;
+        if (options.count("-miss-penalty")) {
+            try {
+                miss_penalty = stoull(option_args["-miss-penalty"]);
+            } catch (logic_error &) {
+                report_error("invalid miss penalty");
+                exit(1);
             }
         }
+        cache_sim = new CacheSim(sim, miss_penalty);
+        string error;
+        if (!cache_sim->add_configs(option_args["-cache"], error)) {
+            report_error(error);
+            exit(1);
+        }
+        cpu->add_monitor(cache_sim);
+    }
+    BranchSim *branch_sim = nullptr;
+    if (options.count("-bpred")) {
+        size_t worst_sites = DEFAULT_BPRED_WORST;
+        if (options.count("-bpred-worst")) {
+            try {
+                worst_sites = stoull(option_args["-bpred-worst"]);
+            } catch (logic_error &) {
+                report_error("invalid number of worst branches");
+                exit(1);
+            }
+        }
+        branch_sim = new BranchSim(sim, worst_sites);
+        string error;
+        if (!branch_sim->add_predictors(option_args["-bpred"], error)) {
+            report_error(error);
+            exit(1);
+        }
+        cpu->add_monitor(branch_sim);
+    }
+    TraceWriter *trace = nullptr;
+    if (options.count("-trace")) {
+        trace = new TraceWriter();
+        if (!trace->open(option_args["-trace"])) {
+            report_error("cannot open trace file");
+            exit(1);
+        }
+        cpu->add_monitor(trace);
+    }
+    CoSim *cosim = nullptr;
+    if (options.count("-cosim")) {
+        cosim = new CoSim(sim);
+        if (!cosim->open(option_args["-cosim"])) {
+            report_error("cannot open reference trace");
+            exit(1);
+        }
+        cpu->add_monitor(cosim);
     }
 
-    zoi_file.close();
-
-
-    cpu = new CPU(MEM_SIZE, data);
+    UndoLog *undo_log = nullptr; // debug mode only
+    bool is_stopped = false; // by the watchdog or the clock budget
+    OutputChecker *expect = nullptr;
+    if (options.count("-expect")) {
+        uint32_t tolerance = 0;
+        if (options.count("-expect-tolerance")) {
+            try {
+                tolerance = stoul(option_args["-expect-tolerance"]);
+            } catch (logic_error &) {
+                report_error("invalid expected output tolerance");
+                exit(1);
+            }
+        }
+        expect = new OutputChecker(sim, tolerance);
+        if (!expect->open(option_args["-expect"])) {
+            report_error("cannot open expected output");
+            exit(1);
+        }
+        sim->io().check_output(expect);
+    }
 
     if (is_debug_mode) {
-        if (!is_debug_file) {
+        if (!sim->image().has_debug_info()) {
             report_error("you must specify binary with debug info when in debug mode");
             exit(1);
         }
+        if (undo_size > 0) {
+            undo_log = new UndoLog(cpu, sim->insts(), undo_size);
+            cpu->set_undo_log(undo_log);
+        }
 
         for (;;) {
-            print_prompt();
+            print_prompt(sim);
 
             string cmd;
             getline(cin, cmd);
-            bool is_next = process_command(cmd);
+            bool is_next = process_command(sim, undo_log, cmd);
             if (!is_next)
                 break;
         }
     } else {
-        while(step_and_report(is_show_last_state))
-            ;
+        auto start_time = chrono::steady_clock::now();
+        bool res = run_budgeted(sim, max_clocks, options.count("-watchdog"), is_stopped, checkpoint_at, [&]() {
+            if (!sim->save_checkpoint(checkpoint_name))
+                report_error("cannot write checkpoint");
+            else if (!is_silent)
+                cerr << "Saved checkpoint to " << checkpoint_name << " at " << checkpoint_at << " clocks." << endl;
+        });
+        report_stop(sim, res, is_show_last_state);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+
         if (cpu->is_halted()) {
             if (!is_show_last_state && !is_silent) {
                 cerr << "Execution finished." << endl;
                 cerr << "Elapsed "<< cpu->get_clocks() << " clocks." << endl;
             }
         }
+        if (is_show_mips) {
+            cerr << "Simulated " << fixed << setprecision(2) << cpu->get_clocks() / elapsed.count() / 1e6
+                 << " MIPS (" << elapsed.count() << " s)." << defaultfloat << endl;
+        }
     }
 
-    delete cpu;
-
-    if (is_show_stat)
-        cpu->print_inst_stat(is_sort_stat);
+    if (trace && !trace->close())
+        report_error("cannot write trace file");
+    if (cosim && !is_silent)
+        cosim->print();
+    bool is_matched = !cosim || cosim->is_passed();
+    bool is_expected = !expect || expect->is_passed();
+    if (expect && !is_silent)
+        expect->print();
+
+    if (is_show_stat) {
+        cpu->print_inst_stat(sim->insts(), is_sort_stat);
+        cpu->print_mem_stat();
+    }
     if (is_show_max)
         cpu->print_max();
     if (is_show_ulines)
-        show_unreached_lines();
+        show_unreached_lines(sim);
     if (is_show_ulabels)
-        show_unreached_labels();
-
-    return 0;
+        show_unreached_labels(sim);
+    if (is_profile)
+        show_profile(sim);
+    if (is_callgraph)
+        call_graph->print();
+    if (options.count("-callgraph-out") && !call_graph->write_collapsed(option_args["-callgraph-out"]))
+        report_error("cannot write call graph");
+    if (timing && !is_silent)
+        timing->print();
+    if (cache_sim && !is_silent)
+        cache_sim->print();
+    if (branch_sim && !is_silent)
+        branch_sim->print();
+
+    delete call_graph;
+    delete timing;
+    delete cache_sim;
+    delete branch_sim;
+    delete trace;
+    delete cosim;
+    delete expect;
+    delete undo_log;
+    delete sim;
+
+    return is_expected && is_matched && !is_stopped ? 0 : 1;
 }
 
@@ -0,0 +1,197 @@
+#include <new>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+using namespace std;
+
+#include "common.h"
+
+const uint64_t PAGEMAP_PRESENT = 1ull << 63, PAGEMAP_SWAPPED = 1ull << 62;
+
+// Demand-zero anonymous mapping: nothing is committed until the guest
+// touches it, so startup cost and RSS follow the program's footprint.
+// With is_guard, the whole 4 GiB reachable by a word index is reserved and
+// everything past the valid region stays PROT_NONE. nullptr on failure
+static uint32_t *reserve(size_t bytes, size_t reserved, bool is_guard)
+{
+    void *p = mmap(nullptr, reserved, is_guard ? PROT_NONE : PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    if (is_guard && mprotect(p, bytes, PROT_READ | PROT_WRITE) != 0) {
+        munmap(p, reserved);
+        return nullptr;
+    }
+    return static_cast<uint32_t *>(p);
+}
+
+GuestMemory::GuestMemory(uint32_t size, bool is_guard)
+{
+    len = size;
+    bytes = (size_t)size * sizeof(uint32_t);
+    reserved = is_guard ? GUARD_RESERVE : bytes;
+    base = reserve(bytes, reserved, is_guard);
+    if (!base)
+        throw bad_alloc();
+    peak = 0;
+}
+
+GuestMemory::~GuestMemory()
+{
+    munmap(base, reserved);
+}
+
+bool GuestMemory::is_guard_addr(const void *addr)
+{
+    const char *a = static_cast<const char *>(addr), *b = reinterpret_cast<const char *>(base);
+    return reserved > bytes && a >= b + bytes && a < b + reserved;
+}
+
+uint64_t GuestMemory::resident_pages()
+{
+    size_t page = page_size();
+    vector<unsigned char> vec((bytes + page - 1) / page);
+    if (mincore(base, bytes, vec.data()) != 0)
+        return 0;
+    uint64_t n = 0;
+    for (unsigned char v : vec)
+        n += v & 1;
+    return n;
+}
+
+// only clear() and map_pages() give pages back, so the resident count
+// before them is enough to know the peak
+uint64_t GuestMemory::peak_pages()
+{
+    return max(peak, resident_pages());
+}
+
+size_t GuestMemory::page_size()
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+// Pages that may not be all zero: touched according to /proc/self/pagemap,
+// which unlike mincore also counts pages that were swapped out, and those
+// still read from a checkpoint file. Every page if pagemap is unreadable.
+vector<uint32_t> GuestMemory::touched_pages()
+{
+    size_t page = page_size();
+    size_t n = (bytes + page - 1) / page;
+    vector<uint64_t> entries(n);
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    off_t from = (off_t)(reinterpret_cast<uintptr_t>(base) / page * sizeof(uint64_t));
+    ssize_t want = n * sizeof(uint64_t);
+    bool is_known = fd >= 0 && pread(fd, entries.data(), want, from) == want;
+    if (fd >= 0)
+        close(fd);
+    vector<uint32_t> pages;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!is_known || (entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) || (i < mapped.size() && mapped[i]))
+            pages.push_back(i);
+    }
+    return pages;
+}
+
+vector<uint32_t> GuestMemory::used_pages()
+{
+    size_t page = page_size();
+    vector<uint32_t> pages;
+    const char *b = reinterpret_cast<const char *>(base);
+    for (uint32_t i : touched_pages()) {
+        const char *p = b + (size_t)i * page, *end = b + min((size_t)(i + 1) * page, bytes);
+        if (any_of(p, end, [](char c) { return c != 0; }))
+            pages.push_back(i);
+    }
+    return pages;
+}
+
+// order-sensitive over words, in four independent lanes for speed
+static uint64_t hash_words(const uint32_t *p, size_t n, bool &is_zero)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15;
+    uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4, any = 0;
+    const uint64_t *q = reinterpret_cast<const uint64_t *>(p);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8, q += 4) {
+        h0 = (h0 ^ q[0]) * k;
+        h1 = (h1 ^ q[1]) * k;
+        h2 = (h2 ^ q[2]) * k;
+        h3 = (h3 ^ q[3]) * k;
+        any |= q[0] | q[1] | q[2] | q[3];
+    }
+    for (; i < n; i++) {
+        h0 = (h0 ^ p[i]) * k;
+        any |= p[i];
+    }
+    is_zero = any == 0;
+    return ((h0 * 31 + h1) * 31 + h2) * 31 + h3;
+}
+
+// untouched and all-zero pages hash alike, so only touched pages are read
+uint64_t GuestMemory::content_hash()
+{
+    size_t page = page_size();
+    uint64_t h = 0;
+    for (uint32_t i : touched_pages()) {
+        size_t start = (size_t)i * page;
+        bool is_zero;
+        uint64_t ph = hash_words(base + start / sizeof(uint32_t), (min(start + page, bytes) - start) / sizeof(uint32_t),
+                                 is_zero);
+        if (!is_zero)
+            h = (h ^ ph ^ i) * 0x100000001b3;
+    }
+    return h;
+}
+
+// a fresh demand-zero mapping in place, so the pages are given back
+bool GuestMemory::clear()
+{
+    mapped.clear();
+    peak = 0;
+    return mmap(base, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0)
+           != MAP_FAILED;
+}
+
+// The pages go into a fresh reservation that replaces the old one only
+// once all of them are mapped, so a failure leaves the memory as it was.
+bool GuestMemory::map_pages(int fd, off_t offset, const vector<uint32_t> &pages)
+{
+    size_t page = page_size();
+    uint32_t *new_base = reserve(bytes, reserved, is_guarded());
+    if (!new_base)
+        return false;
+    char *b = reinterpret_cast<char *>(new_base);
+    vector<bool> new_mapped((bytes + page - 1) / page, false);
+
+    for (size_t i = 0; i < pages.size(); ) {
+        size_t j = i + 1; // run of consecutive pages, contiguous in the file too
+        while (j < pages.size() && pages[j] == pages[j - 1] + 1)
+            j++;
+        size_t start = (size_t)pages[i] * page, len = (j - i) * page;
+        off_t from = offset + (off_t)(i * page);
+        bool ok;
+        if (start + len > bytes) { // partial last page: not mappable in place
+            size_t n = bytes - start;
+            ok = n == 0 || pread(fd, b + start, n, from) == (ssize_t)n;
+        } else
+            ok = mmap(b + start, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, from) != MAP_FAILED;
+        if (!ok) {
+            munmap(new_base, reserved);
+            return false;
+        }
+        for (size_t k = i; k < j; k++)
+            new_mapped[pages[k]] = true;
+        i = j;
+    }
+
+    peak = peak_pages(); // the same run goes on
+    munmap(base, reserved);
+    base = new_base;
+    mapped.swap(new_mapped);
+    return true;
+}
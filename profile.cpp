@@ -0,0 +1,266 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+#include "common.h"
+
+const int PROFILE_HOT_LINES = 10;
+
+// start index of every label, sorted; used to find the enclosing label
+static vector<pair<uint32_t, string>> label_starts(Simulator *sim)
+{
+    vector<pair<uint32_t, string>> starts;
+    for (const string &label : sim->image().labels()) {
+        try {
+            starts.push_back(make_pair(sim->text_addr_of_lnum(sim->lnum_of_label(label)) >> 2, label));
+        } catch (out_of_range &) { // label after the last instruction
+        }
+    }
+    // several labels on one address: the last one, closest to the code, wins
+    stable_sort(starts.begin(), starts.end(),
+                [](const pair<uint32_t, string> &a, const pair<uint32_t, string> &b) { return a.first < b.first; });
+    return starts;
+}
+
+// per text index counts summed under the enclosing label, descending
+vector<pair<uint64_t, string>> sum_by_label(Simulator *sim, const vector<uint64_t> &count_at)
+{
+    vector<pair<uint32_t, string>> starts;
+    if (sim->image().has_debug_info())
+        starts = label_starts(sim);
+    vector<pair<uint64_t, string>> by_label(1, make_pair(0, "(no label)"));
+    size_t next = 0;
+    for (uint32_t i = 0; i < count_at.size(); i++) {
+        if (next < starts.size() && starts[next].first == i) {
+            while (next < starts.size() && starts[next].first == i)
+                next++;
+            by_label.push_back(make_pair(0, starts[next - 1].second));
+        }
+        by_label.back().first += count_at[i];
+    }
+
+    stable_sort(by_label.begin(), by_label.end(),
+                [](const pair<uint64_t, string> &a, const pair<uint64_t, string> &b) { return a.first > b.first; });
+    return by_label;
+}
+
+static void print_percent(ostream &os, uint64_t n, uint64_t total)
+{
+    os << fixed << setprecision(2) << setfill(' ') << setw(6) << (total ? 100.0 * n / total : 0.0) << "%" << defaultfloat;
+}
+
+// flat profile from the per-PC execution counts
+void show_profile(Simulator *sim)
+{
+    ostream &log = sim->log();
+    CPU *cpu = sim->get_cpu();
+    const vector<DecodedInst> &dinsts = sim->insts();
+    uint32_t text_len = dinsts.size();
+    uint64_t total = 0;
+    vector<uint64_t> self(text_len); // clocks; invalid instructions take none
+    for (uint32_t i = 0; i < text_len; i++) {
+        if (dinsts[i].type != InstType::sentinel)
+            self[i] = cpu->get_exec_count(i);
+        total += self[i];
+    }
+
+    log << endl << "[Profile]" << endl;
+    log << total << " clocks in total." << endl << endl;
+
+    vector<pair<uint64_t, string>> by_label = sum_by_label(sim, self);
+
+    log << setw(14) << setfill(' ') << "self clocks" << "       %  label" << endl;
+    for (auto &p : by_label) {
+        if (p.first == 0)
+            break;
+        log << setw(14) << setfill(' ') << p.first << "  ";
+        print_percent(log, p.first, total);
+        log << "  " << p.second << endl;
+    }
+
+    vector<uint32_t> hot;
+    for (uint32_t i = 0; i < text_len; i++) {
+        if (dinsts[i].type != InstType::sentinel && cpu->get_exec_count(i) > 0)
+            hot.push_back(i);
+    }
+    stable_sort(hot.begin(), hot.end(),
+                [cpu](uint32_t a, uint32_t b) { return cpu->get_exec_count(a) > cpu->get_exec_count(b); });
+    if (hot.size() > PROFILE_HOT_LINES)
+        hot.resize(PROFILE_HOT_LINES);
+
+    log << endl << "Hottest lines:" << endl;
+    for (uint32_t i : hot) {
+        log << setw(14) << setfill(' ') << cpu->get_exec_count(i) << "  ";
+        print_percent(log, cpu->get_exec_count(i), total);
+        log << "  ";
+        sim->print_line(i << 2);
+    }
+}
+
+CallGraph::CallGraph(Simulator *sim) : sim(sim), clocks(0), func_at(sim->insts().size(), UINT32_MAX)
+{
+    uint32_t text_len = func_at.size();
+    if (sim->image().has_debug_info()) {
+        for (auto &p : label_starts(sim)) {
+            if (p.first >= text_len)
+                continue;
+            if (func_at[p.first] == UINT32_MAX) {
+                func_at[p.first] = func_names.size();
+                func_names.push_back(p.second);
+            } else // several labels on one address: the last one wins
+                func_names[func_at[p.first]] = p.second;
+        }
+    }
+    if (text_len > 0 && func_at[0] == UINT32_MAX) {
+        func_at[0] = func_names.size();
+        func_names.push_back("(top)");
+    }
+    calls.resize(func_names.size());
+    inclusive.resize(func_names.size());
+    exclusive.resize(func_names.size());
+    active.resize(func_names.size());
+
+    uint32_t top = func_of(0);
+    nodes.push_back({top, 0, 0});
+    stack.push_back({0, 0});
+    active[top]++;
+}
+
+uint32_t CallGraph::func_of(uint32_t addr)
+{
+    uint32_t idx = addr >> 2;
+    if (idx < func_at.size() && func_at[idx] != UINT32_MAX)
+        return func_at[idx];
+
+    ostringstream name;
+    name << "0x" << hex << setw(8) << setfill('0') << addr;
+    uint32_t func = func_names.size();
+    func_names.push_back(name.str());
+    calls.push_back(0);
+    inclusive.push_back(0);
+    exclusive.push_back(0);
+    active.push_back(0);
+    if (idx < func_at.size())
+        func_at[idx] = func;
+    return func;
+}
+
+void CallGraph::push(uint32_t func)
+{
+    uint32_t parent = stack.back().node;
+    uint64_t key = (uint64_t)parent << 32 | func;
+    auto it = children.find(key);
+    uint32_t node;
+    if (it != children.end())
+        node = it->second;
+    else {
+        node = nodes.size();
+        nodes.push_back({func, parent, 0});
+        children[key] = node;
+    }
+
+    calls[func]++;
+    edges[make_pair(nodes[parent].func, func)]++;
+    active[func]++;
+    stack.push_back({node, clocks});
+}
+
+void CallGraph::pop()
+{
+    uint32_t func = nodes[stack.back().node].func;
+    if (--active[func] == 0)
+        inclusive[func] += clocks - stack.back().entry_clock;
+    stack.pop_back();
+}
+
+void CallGraph::retire(const RetireEvent &e)
+{
+    clocks++;
+    Node &cur = nodes[stack.back().node];
+    cur.self++;
+    exclusive[cur.func]++;
+
+    const DecodedInst &inst = *e.inst;
+    if ((inst.type == InstType::jal || inst.type == InstType::jalr) && inst.rd == 1)
+        push(func_of(e.next_pc));
+    else if (inst.type == InstType::jalr && inst.rd == 0 && inst.rs1 == 1 && inst.imm == 0 && stack.size() > 1)
+        pop();
+}
+
+// closes the frames still open when the program stops
+void CallGraph::unwind()
+{
+    while (!stack.empty())
+        pop();
+    uint32_t top = nodes[0].func;
+    stack.push_back({0, clocks});
+    active[top]++;
+}
+
+void CallGraph::print()
+{
+    ostream &log = sim->log();
+    unwind();
+
+    log << endl << "[Call Graph]" << endl;
+    log << clocks << " clocks in total." << endl << endl;
+
+    vector<uint32_t> funcs;
+    for (uint32_t i = 0; i < func_names.size(); i++) {
+        if (calls[i] > 0 || i == nodes[0].func)
+            funcs.push_back(i);
+    }
+    stable_sort(funcs.begin(), funcs.end(),
+                [this](uint32_t a, uint32_t b) { return inclusive[a] > inclusive[b]; });
+
+    log << setw(10) << setfill(' ') << "calls" << setw(16) << "inclusive" << "       %"
+         << setw(16) << "exclusive" << "       %  function" << endl;
+    for (uint32_t i : funcs) {
+        log << setw(10) << setfill(' ') << calls[i] << setw(16) << inclusive[i] << "  ";
+        print_percent(log, inclusive[i], clocks);
+        log << setw(16) << setfill(' ') << exclusive[i] << "  ";
+        print_percent(log, exclusive[i], clocks);
+        log << "  " << func_names[i] << endl;
+    }
+
+    vector<pair<pair<uint32_t, uint32_t>, uint64_t>> sorted_edges(edges.begin(), edges.end());
+    stable_sort(sorted_edges.begin(), sorted_edges.end(),
+                [](const pair<pair<uint32_t, uint32_t>, uint64_t> &a, const pair<pair<uint32_t, uint32_t>, uint64_t> &b) {
+                    return a.second > b.second;
+                });
+    log << endl << "Call edges:" << endl;
+    for (auto &e : sorted_edges) {
+        log << setw(10) << setfill(' ') << e.second << "  "
+             << func_names[e.first.first] << " -> " << func_names[e.first.second] << endl;
+    }
+}
+
+bool CallGraph::write_collapsed(const string &name)
+{
+    ofstream ofs(name);
+    if (!ofs)
+        return false;
+    unwind();
+
+    for (uint32_t n = 0; n < nodes.size(); n++) {
+        if (nodes[n].self == 0)
+            continue;
+        vector<uint32_t> path;
+        for (uint32_t m = n; ; m = nodes[m].parent) {
+            path.push_back(nodes[m].func);
+            if (m == 0)
+                break;
+        }
+        for (auto it = path.rbegin(); it != path.rend(); ++it)
+            ofs << (it == path.rbegin() ? "" : ";") << func_names[*it];
+        ofs << " " << nodes[n].self << endl;
+    }
+    return bool(ofs);
+}
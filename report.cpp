@@ -5,13 +5,13 @@
 
 using namespace std;
 
-void report_error(string message)
+void report_error(string message, ostream &os)
 {
-    cerr << "error: " << message << endl;
+    os << "error: " << message << endl;
 }
 
-void report_warning(string message)
+void report_warning(string message, ostream &os)
 {
-    cerr << "warning: " << message << endl;
+    os << "warning: " << message << endl;
 }
 
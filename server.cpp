@@ -0,0 +1,401 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <memory>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+using namespace std;
+
+#include "common.h"
+
+const size_t SERVER_POOL_LEN = 64; // idle simulators kept
+
+// a simulator with the log it writes to, kept after its job to run the
+// same program again without allocating guest memory or translating anew
+struct PooledSimulator
+{
+    ostringstream log;
+    Simulator sim;
+
+    PooledSimulator(const Simulator::Options &options) : sim(options, log) {}
+};
+
+// programs by content hash, shared by all the jobs running them, and the
+// simulators of finished jobs; a program is dropped with its last user
+class ProgramCache
+{
+public:
+    ~ProgramCache()
+    {
+        for (auto &p : idle)
+            delete p.second;
+    }
+
+    shared_ptr<const Program> find(uint64_t hash)
+    {
+        lock_guard<mutex> lock(mtx);
+        auto it = programs.find(hash);
+        return it != programs.end() ? it->second.lock() : nullptr;
+    }
+
+    void add(uint64_t hash, shared_ptr<const Program> program)
+    {
+        lock_guard<mutex> lock(mtx);
+        for (auto it = programs.begin(); it != programs.end(); ) {
+            if (it->second.expired())
+                it = programs.erase(it);
+            else
+                ++it;
+        }
+        programs[hash] = program;
+    }
+
+    // an idle simulator of the program, most recently used first
+    PooledSimulator *take(const Program *program)
+    {
+        lock_guard<mutex> lock(mtx);
+        for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+            if (it->first == program) {
+                PooledSimulator *pooled = it->second;
+                idle.erase(next(it).base());
+                return pooled;
+            }
+        }
+        return nullptr;
+    }
+
+    // the least recently used one goes when the pool is full
+    void put(const Program *program, PooledSimulator *pooled)
+    {
+        PooledSimulator *dropped = nullptr;
+        {
+            lock_guard<mutex> lock(mtx);
+            idle.push_back(make_pair(program, pooled));
+            if (idle.size() > SERVER_POOL_LEN) {
+                dropped = idle.front().second;
+                idle.pop_front();
+            }
+        }
+        delete dropped;
+    }
+
+private:
+    mutex mtx;
+    unordered_map<uint64_t, weak_ptr<const Program>> programs;
+    deque<pair<const Program *, PooledSimulator *>> idle; // each keeps its program alive
+};
+
+// one client; the replies of its jobs may interleave, so every reply line
+// is sent whole and carries the number of its job
+class Connection
+{
+public:
+    Connection(int fd) : fd(fd), jobs(0) {}
+    ~Connection() { close(fd); }
+
+    int get_fd() { return fd; }
+    uint64_t next_job() { return ++jobs; } // 1-origin, in the order of the lines
+
+    // reads what has arrived and appends the completed lines; false once
+    // the client has closed its end
+    bool receive(vector<string> &lines)
+    {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR)
+            return true;
+        if (n <= 0)
+            return false;
+        buf.append(chunk, n);
+        size_t start = 0, end;
+        while ((end = buf.find('\n', start)) != string::npos) {
+            lines.push_back(buf.substr(start, end - start));
+            start = end + 1;
+        }
+        buf.erase(0, start);
+        return true;
+    }
+
+    void send_line(const string &line)
+    {
+        lock_guard<mutex> lock(mtx);
+        send_all(line.data(), line.size());
+        send_all("\n", 1);
+    }
+
+    // "HEAD LEN\n" followed by LEN bytes
+    void send_frame(const string &head, const char *data, size_t len)
+    {
+        string line = head + " " + to_string(len) + "\n";
+        lock_guard<mutex> lock(mtx);
+        send_all(line.data(), line.size());
+        send_all(data, len);
+    }
+
+private:
+    int fd;
+    string buf; // received, not yet a whole line
+    mutex mtx; // one sender at a time
+    uint64_t jobs;
+
+    void send_all(const char *data, size_t len)
+    {
+        while (len > 0) {
+            ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+            if (n <= 0) // the client is gone; the job runs to the end unseen
+                return;
+            data += n;
+            len -= n;
+        }
+    }
+};
+
+// a request line waiting for a pool thread
+struct Job
+{
+    shared_ptr<Connection> conn;
+    string id;
+    vector<string> args;
+};
+
+// the guest output of one job, as "out ID LEN" frames
+class JobOutput : public OutputSink
+{
+public:
+    JobOutput(Job &job) : job(job) {}
+    void write(const char *data, size_t len) override { job.conn->send_frame("out " + job.id, data, len); }
+
+private:
+    Job &job;
+};
+
+static void send_stat(Job &job, Simulator &sim)
+{
+    const vector<DecodedInst> &dinsts = sim.insts();
+    uint64_t inst_stat[INST_LEN] = {};
+    for (uint32_t i = 0; i < dinsts.size(); i++) {
+        if (dinsts[i].type != InstType::sentinel)
+            inst_stat[static_cast<int>(dinsts[i].type)] += sim.get_cpu()->get_exec_count(i);
+    }
+    for (int i = 0; i < INST_LEN; i++) {
+        if (inst_stat[i] > 0)
+            job.conn->send_line("stat " + job.id + " " + inst_type_to_string(static_cast<InstType>(i)) + " "
+                                + to_string(inst_stat[i]));
+    }
+}
+
+// "PROGRAM INPUT [OPTIONS]" -> out/log frames, stat lines, then
+// "done ID STATUS CLOCKS SECONDS"
+static void serve_job(Job &job, ProgramCache &cache)
+{
+    auto start_time = chrono::steady_clock::now();
+    Connection &conn = *job.conn;
+    const vector<string> &args = job.args;
+    const string done = "done " + job.id + " ";
+    Simulator::Options options;
+    bool is_show_stat = false;
+    uint64_t max_clocks = UINT64_MAX;
+    bool is_watchdog = false;
+    bool is_valid = args.size() >= 2;
+    for (size_t i = 2; is_valid && i < args.size(); i++) {
+        if (args[i] == "-max-clocks") {
+            try {
+                max_clocks = stoull(args.at(++i));
+            } catch (logic_error &) {
+                is_valid = false;
+            }
+        }
+        else if (args[i] == "-threaded")
+            options.engine = Engine::threaded;
+        else if (args[i] == "-blocks")
+            options.engine = Engine::blocks;
+        else if (args[i] == "-jit")
+            options.engine = Engine::jit;
+        else if (args[i] == "-show-stat")
+            is_show_stat = options.is_count = true;
+        else if (args[i] == "-watchdog")
+            is_watchdog = options.is_count = true;
+        else
+            is_valid = false;
+    }
+    if (!is_valid) {
+        conn.send_line(done + "BADREQUEST 0 0");
+        return;
+    }
+
+    // the bytes hashed are the bytes loaded, even if the file is rewritten
+    shared_ptr<Program> loaded = make_shared<Program>();
+    if (!loaded->zoi.open(args[0])) {
+        conn.send_line(done + "NOLOAD 0 0");
+        return;
+    }
+    uint64_t hash = loaded->zoi.content_hash();
+    shared_ptr<const Program> program = cache.find(hash);
+    string error;
+    if (!program) {
+        if (!loaded->decode(error)) {
+            ostringstream log_os;
+            report_error(error, log_os);
+            string log = log_os.str();
+            conn.send_frame("log " + job.id, log.data(), log.size());
+            conn.send_line(done + "NOLOAD 0 0");
+            return;
+        }
+        program = loaded;
+        cache.add(hash, program);
+    }
+    loaded.reset();
+
+    PooledSimulator *pooled = cache.take(program.get());
+    if (pooled) {
+        pooled->log.str("");
+        if (!pooled->sim.reset(options, error)) {
+            delete pooled;
+            pooled = nullptr;
+        }
+    }
+    if (!pooled) {
+        pooled = new PooledSimulator(options);
+        if (!pooled->sim.load(program, error)) {
+            report_error(error, pooled->log);
+            string log = pooled->log.str();
+            conn.send_frame("log " + job.id, log.data(), log.size());
+            conn.send_line(done + "NOLOAD 0 0");
+            delete pooled;
+            return;
+        }
+    }
+    Simulator &sim = pooled->sim;
+    if (!sim.io().open_input(args[1])) {
+        conn.send_line(done + "NOINPUT 0 0");
+        cache.put(program.get(), pooled);
+        return;
+    }
+
+    JobOutput out(job);
+    sim.io().capture_output(&out);
+    bool is_stopped;
+    bool res = run_budgeted(&sim, max_clocks, is_watchdog, is_stopped);
+    sim.io().flush();
+    sim.io().capture_output();
+    CPU *cpu = sim.get_cpu();
+    string log = pooled->log.str();
+    if (!log.empty())
+        conn.send_frame("log " + job.id, log.data(), log.size());
+    if (is_show_stat)
+        send_stat(job, sim);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    ostringstream reply;
+    reply << done << (!res || cpu->is_exception() ? "ERROR" : "DONE") << " " << cpu->get_clocks() << " " << fixed
+          << setprecision(6) << elapsed.count();
+    conn.send_line(reply.str());
+    cache.put(program.get(), pooled);
+}
+
+int run_server(const string &socket_name, unsigned jobs)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_name.size() >= sizeof(addr.sun_path)) {
+        report_error("socket path is too long");
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_name.c_str());
+
+    // a socket left by an earlier server is replaced, anything else is kept
+    struct stat st;
+    if (lstat(socket_name.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            report_error(socket_name + " exists and is not a socket");
+            return 1;
+        }
+        unlink(socket_name.c_str());
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        report_error("cannot listen on " + socket_name);
+        return 1;
+    }
+    cerr << "Serving on " << socket_name << " with " << jobs << " threads." << endl;
+
+    ProgramCache cache;
+    mutex mtx;
+    condition_variable is_ready;
+    deque<Job> pending;
+    vector<thread> workers;
+    for (unsigned i = 0; i < jobs; i++) {
+        workers.push_back(thread([&]() {
+            for (;;) {
+                unique_lock<mutex> lock(mtx);
+                is_ready.wait(lock, [&]() { return !pending.empty(); });
+                Job job = move(pending.front());
+                pending.pop_front();
+                lock.unlock();
+                serve_job(job, cache);
+            }
+        }));
+    }
+
+    // This thread accepts clients and reads all their requests, so a pool
+    // thread is taken only while a job runs, and the jobs of one client run
+    // at once like those of different clients. A client that has closed its
+    // end still gets the replies of its queued jobs.
+    vector<shared_ptr<Connection>> conns;
+    for (;;) {
+        vector<pollfd> fds(1 + conns.size());
+        fds[0] = {listen_fd, POLLIN, 0};
+        for (size_t i = 0; i < conns.size(); i++)
+            fds[1 + i] = {conns[i]->get_fd(), POLLIN, 0};
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            report_error("cannot wait for clients");
+            break;
+        }
+
+        for (size_t i = conns.size(); i-- > 0; ) {
+            if (!fds[1 + i].revents)
+                continue;
+            vector<string> lines;
+            bool is_open = conns[i]->receive(lines);
+            for (const string &line : lines) {
+                vector<string> args = split_string(line, " \t\r");
+                if (args.empty())
+                    continue;
+                lock_guard<mutex> lock(mtx);
+                pending.push_back({conns[i], to_string(conns[i]->next_job()), args});
+                is_ready.notify_one();
+            }
+            if (!is_open)
+                conns.erase(conns.begin() + i);
+        }
+
+        if (fds[0].revents) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0)
+                conns.push_back(make_shared<Connection>(fd));
+            else if (errno != EINTR && errno != ECONNABORTED) {
+                report_error("cannot accept a connection");
+                break;
+            }
+        }
+    }
+    exit(1); // the workers still use the cache and never return
+}
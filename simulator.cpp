@@ -0,0 +1,201 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <new>
+
+using namespace std;
+
+#include "common.h"
+
+const uint32_t WORD_SIZE = 4;
+
+Simulator::~Simulator()
+{
+    delete cpu;
+}
+
+shared_ptr<const Program> Program::load(const string &zoi_name, string &error)
+{
+    shared_ptr<Program> program = make_shared<Program>();
+    if (!program->zoi.open(zoi_name)) {
+        error = "no such zoi file";
+        return nullptr;
+    }
+    if (!program->decode(error))
+        return nullptr;
+    return program;
+}
+
+bool Program::decode(string &error)
+{
+    if (!zoi.has_valid_magic()) {
+        error = "invalid file type";
+        return false;
+    }
+    if (!zoi.is_complete()) {
+        error = "zoi file is truncated";
+        return false;
+    }
+    dinsts = decode_insts(zoi.text(), zoi.text_len());
+    return true;
+}
+
+bool Simulator::load(const string &zoi_name, string &error)
+{
+    shared_ptr<const Program> program = Program::load(zoi_name, error);
+    return program && load(program, error);
+}
+
+bool Simulator::load(shared_ptr<const Program> program, string &error)
+{
+    if (options.is_guard_mem && options.engine != Engine::jit) { // only the JIT drops its bounds checks
+        error = "guard-page memory needs the JIT";
+        return false;
+    }
+    const ZoiImage &zoi = program->zoi;
+    if (zoi.data_len() > options.mem_size) {
+        error = "static data is too large";
+        return false;
+    }
+
+    this->program = program;
+    try {
+        cpu = new CPU(this, options.mem_size, zoi.data(), zoi.data_len(), zoi.text_len(), &guest_io,
+                      options.is_guard_mem);
+    } catch (bad_alloc &) {
+        error = "cannot allocate guest memory";
+        return false;
+    }
+    return true;
+}
+
+bool Simulator::reset(const Options &new_options, string &error)
+{
+    uint32_t mem_size = options.mem_size;
+    bool is_guard_mem = options.is_guard_mem;
+    options = new_options;
+    options.mem_size = mem_size;
+    options.is_guard_mem = is_guard_mem;
+    if (!cpu->reset(program->zoi.data(), program->zoi.data_len())) {
+        error = "cannot clear guest memory";
+        return false;
+    }
+    return true;
+}
+
+unsigned Simulator::features()
+{
+    unsigned features = 0;
+    if (options.is_show_max)
+        features |= FEAT_MAX;
+    if (options.is_count)
+        features |= FEAT_COUNT;
+    if (options.is_nan_check)
+        features |= FEAT_NAN;
+    if (cpu->has_monitors())
+        features |= FEAT_HOOK;
+    if (cpu->get_undo_log()) // back takes the executions away again
+        features |= FEAT_UNDO | FEAT_COUNT;
+    return features;
+}
+
+bool Simulator::run(uint64_t max_clocks)
+{
+    // The monitors (-timing, -cache, -bpred, ...) and the undo log see every
+    // instruction, which blocks and compiled code do not stop for; those runs
+    // take the threaded loop the options would give with -threaded.
+    if (options.engine != Engine::step && (cpu->has_monitors() || cpu->get_undo_log()))
+        return (cpu->*CPU::threaded_loop(features()))(program->dinsts, max_clocks);
+    switch (options.engine) {
+        case Engine::step:
+            while (!cpu->is_halted() && !cpu->is_exception() && cpu->get_clocks() < max_clocks) {
+                if (!step_exec(cpu, program->dinsts))
+                    return false;
+            }
+            return true;
+        case Engine::blocks:
+            return cpu->run_blocks(program->dinsts, max_clocks);
+        case Engine::jit:
+            return cpu->run_jit(program->dinsts, max_clocks);
+        default:
+            return (cpu->*CPU::threaded_loop(features()))(program->dinsts, max_clocks);
+    }
+}
+
+bool Simulator::step()
+{
+    return step_exec(cpu, program->dinsts);
+}
+
+bool Simulator::run_to_breakpoint(uint64_t max_clocks)
+{
+    return (cpu->*CPU::threaded_loop(features() | FEAT_BREAK))(program->dinsts, max_clocks);
+}
+
+void Simulator::print_line(uint32_t addr)
+{
+    if (addr & 0b11)
+        throw invalid_argument("Simulator::print_line");
+    uint32_t idx = addr >> 2;
+    if (!(idx < program->zoi.text_len()))
+        throw out_of_range("Simulator::print_line");
+    if (!program->zoi.has_debug_info()) {
+        print_hex(addr, log_os);
+        log_os << endl;
+        return;
+    }
+    uint32_t cur_lnum = program->zoi.inst_lines()[idx];
+    log_os << cur_lnum << ": " << program->zoi.source_line(cur_lnum) << endl;
+}
+
+uint32_t Simulator::get_word_of_text_addr(uint32_t addr)
+{
+    if (addr & 0b11)
+        throw invalid_argument("Simulator::get_word_of_text_addr");
+    uint32_t idx = addr >> 2;
+    if (!(idx < program->zoi.text_len()))
+        throw out_of_range("Simulator::get_word_of_text_addr");
+    return program->zoi.text()[idx];
+}
+
+uint32_t Simulator::text_addr_of_lnum(uint32_t lnum)
+{
+    uint32_t len = program->zoi.has_debug_info() ? program->zoi.text_len() : 0;
+    const uint32_t *inst_lines = program->zoi.inst_lines();
+    uint32_t idx = distance(inst_lines, lower_bound(inst_lines, inst_lines + len, lnum));
+    if (idx >= len)
+        throw out_of_range("Simulator::text_addr_of_lnum");
+    return idx << 2;
+}
+
+uint32_t Simulator::lnum_of_label(const string &label)
+{
+    uint32_t lnum;
+    if (!program->zoi.find_label(label, lnum))
+        throw out_of_range("Simulator::lnum_of_label");
+    return lnum;
+}
+
+void Simulator::add_breakpoint(uint32_t addr)
+{
+    breakpoints.insert(addr);
+    if (is_breakpoint_index.size() <= addr >> 2)
+        is_breakpoint_index.resize((addr >> 2) + 1, false);
+    is_breakpoint_index[addr >> 2] = true;
+}
+
+void Simulator::delete_breakpoint(uint32_t addr)
+{
+    breakpoints.erase(addr); // doesn't care result
+    if (addr >> 2 < is_breakpoint_index.size())
+        is_breakpoint_index[addr >> 2] = false;
+}
+
+void Simulator::delete_all_breakpoints()
+{
+    breakpoints.clear();
+    is_breakpoint_index.clear();
+}
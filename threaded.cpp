@@ -0,0 +1,395 @@
+#include <cmath>
+#include <cfenv>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+#include "common.h"
+
+static inline uint32_t float_to_bits(float x)
+{
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static inline float bits_to_float(uint32_t u)
+{
+    float x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+// Direct-threaded interpreter. PC, registers and clocks live in locals and
+// are written back to the CPU only when the loop is left. Rare paths (memory
+// and NaN exceptions) are delegated to the ordinary CPU methods so that the
+// reports and the final state are identical to step_exec.
+// Each combination of features is a separate instantiation, so a disabled
+// feature leaves no code in the loop.
+template <unsigned features>
+bool CPU::run_threaded(const vector<DecodedInst> &dinsts, uint64_t max_clocks)
+{
+    static const void *const handlers[] = {
+        &&op_add, &&op_sub, &&op_or_, &&op_fadd, &&op_fsub, &&op_fmul, &&op_fsqrt, &&op_fdiv,
+        &&op_fsgnj, &&op_fsgnjn, &&op_fsgnjx, &&op_feq, &&op_fle, &&op_fcvt_w_s, &&op_fcvt_s_w,
+        &&op_fmv_s_x, &&op_addi, &&op_slli, &&op_srai, &&op_lw, &&op_flw, &&op_jalr, &&op_sw,
+        &&op_fsw, &&op_beq, &&op_bne, &&op_blt, &&op_bge, &&op_lui, &&op_jal, &&op_halt,
+        &&op_inb, &&op_outb,
+        &&op_invalid, // InstType::sentinel
+    };
+
+    const uint32_t text_len = dinsts.size();
+    if (threaded_handlers != handlers || threaded_code.size() != text_len + 1) {
+        threaded_handlers = handlers;
+        threaded_code.resize(text_len + 1);
+        for (uint32_t i = 0; i < text_len; i++) {
+            const DecodedInst &d = dinsts[i];
+            threaded_code[i] = {handlers[static_cast<int>(d.type)], d.rd, d.rs1, d.rs2, d.imm};
+        }
+        // falling off the end of the text
+        threaded_code[text_len] = {&&out_of_range, 0, 0, 0, 0};
+    }
+
+    const ThreadedInst *const code = threaded_code.data();
+    const ThreadedInst *ip;
+    uint32_t pc = this->pc, prev_pc = this->prev_pc;
+    uint64_t clocks = this->clocks;
+    uint32_t r[REG_LEN];
+    float f[REG_LEN];
+    copy(this->r, this->r + REG_LEN, r);
+    copy(this->f, this->f + REG_LEN, f);
+    uint32_t *const mem = this->mem.data();
+    uint64_t *const exec_count = this->exec_count.data();
+    const uint32_t mem_size = this->mem_size;
+    const vector<bool> &break_at = sim->breakpoint_index();
+    uint32_t ea = 0; // last load or store address, for monitors
+    bool res = true;
+
+    fesetround(FE_TONEAREST);
+
+#define SAVE_STATE() do { \
+        this->pc = pc; \
+        this->prev_pc = prev_pc; \
+        this->clocks = clocks; \
+        copy(r, r + REG_LEN, this->r); \
+        copy(f, f + REG_LEN, this->f); \
+    } while (0)
+
+#define LOAD_STATE() do { \
+        pc = this->pc; \
+        prev_pc = this->prev_pc; \
+        clocks = this->clocks; \
+        copy(this->r, this->r + REG_LEN, r); \
+        copy(this->f, this->f + REG_LEN, f); \
+    } while (0)
+
+#define RETIRE() do { \
+        if (features & FEAT_MAX) \
+            for (uint32_t i = 0; i < REG_LEN; i++) \
+                r_max[i] = max(r_max[i], r[i]); \
+        clocks++; \
+    } while (0)
+
+#define DISPATCH() do { \
+        if (clocks >= max_clocks) \
+            goto leave; \
+        goto *ip->handler; \
+    } while (0)
+
+// stop in front of a breakpoint, but never before the first instruction;
+// also stop when a monitor raised an exception
+#define CHECK_BREAK() do { \
+        if ((features & FEAT_BREAK) && (uint32_t)(ip - code) < break_at.size() && break_at[ip - code]) \
+            goto leave; \
+        if ((features & FEAT_HOOK) && exception_f) \
+            goto leave; \
+    } while (0)
+
+#define NOTIFY(from, to) do { \
+        if (features & FEAT_HOOK) \
+            notify_retire({(from), (to), &dinsts[ip - code], ea, r, f}); \
+    } while (0)
+
+#define NEXT() do { \
+        NOTIFY(pc, pc + WORD_SIZE); \
+        RETIRE(); \
+        prev_pc = pc; \
+        pc += WORD_SIZE; \
+        ip++; \
+        CHECK_BREAK(); \
+        DISPATCH(); \
+    } while (0)
+
+#define JUMP(target) do { \
+        uint32_t t = (target); \
+        NOTIFY(pc, t); \
+        RETIRE(); \
+        prev_pc = pc; \
+        pc = t; \
+        ip = code + min(pc >> 2, text_len); \
+        CHECK_BREAK(); \
+        DISPATCH(); \
+    } while (0)
+
+#define BEGIN(type) do { \
+        if (features & FEAT_COUNT) \
+            exec_count[ip - code]++; \
+        if (features & FEAT_UNDO) \
+            undo_log->record(pc, r, f, mem, mem_size); \
+    } while (0)
+
+// exceptional case: let the CPU method report it and stop after this clock
+#define SLOW_PATH(call) do { \
+        uint32_t from = pc; \
+        SAVE_STATE(); \
+        call; \
+        LOAD_STATE(); \
+        NOTIFY(from, pc); \
+        RETIRE(); \
+        goto leave; \
+    } while (0)
+
+#define F_RESULT(rd, expr, call) do { \
+        float v = (expr); \
+        if ((features & FEAT_NAN) && isnan(v)) \
+            SLOW_PATH(call); \
+        f[rd] = v; \
+        NEXT(); \
+    } while (0)
+
+    ip = code + min(pc >> 2, text_len);
+    DISPATCH();
+
+    // R type
+op_add:
+    BEGIN(add);
+    r[ip->rd] = r[ip->rs1] + r[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_sub:
+    BEGIN(sub);
+    r[ip->rd] = r[ip->rs1] - r[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_or_:
+    BEGIN(or_);
+    r[ip->rd] = r[ip->rs1] | r[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_fadd:
+    BEGIN(fadd);
+    F_RESULT(ip->rd, f[ip->rs1] + f[ip->rs2], fadd(ip->rd, ip->rs1, ip->rs2));
+op_fsub:
+    BEGIN(fsub);
+    F_RESULT(ip->rd, f[ip->rs1] - f[ip->rs2], fsub(ip->rd, ip->rs1, ip->rs2));
+op_fmul:
+    BEGIN(fmul);
+    F_RESULT(ip->rd, f[ip->rs1] * f[ip->rs2], fmul(ip->rd, ip->rs1, ip->rs2));
+op_fsqrt:
+    BEGIN(fsqrt);
+    F_RESULT(ip->rd, sqrtf(f[ip->rs1]), fsqrt(ip->rd, ip->rs1));
+op_fdiv:
+    BEGIN(fdiv);
+    F_RESULT(ip->rd, f[ip->rs1] / f[ip->rs2], fdiv(ip->rd, ip->rs1, ip->rs2));
+op_fsgnj:
+    BEGIN(fsgnj);
+    F_RESULT(ip->rd,
+             bits_to_float((float_to_bits(f[ip->rs1]) & 0x7fffffff) | (float_to_bits(f[ip->rs2]) & 0x80000000)),
+             fsgnj(ip->rd, ip->rs1, ip->rs2));
+op_fsgnjn:
+    BEGIN(fsgnjn);
+    F_RESULT(ip->rd,
+             bits_to_float((float_to_bits(f[ip->rs1]) & 0x7fffffff) | (~float_to_bits(f[ip->rs2]) & 0x80000000)),
+             fsgnjn(ip->rd, ip->rs1, ip->rs2));
+op_fsgnjx:
+    BEGIN(fsgnjx);
+    F_RESULT(ip->rd,
+             bits_to_float(float_to_bits(f[ip->rs1]) ^ (float_to_bits(f[ip->rs2]) & 0x80000000)),
+             fsgnjx(ip->rd, ip->rs1, ip->rs2));
+op_feq:
+    BEGIN(feq);
+    r[ip->rd] = f[ip->rs1] == f[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_fle:
+    BEGIN(fle);
+    r[ip->rd] = f[ip->rs1] <= f[ip->rs2];
+    r[0] = 0;
+    NEXT();
+op_fcvt_w_s:
+    BEGIN(fcvt_w_s);
+    r[ip->rd] = (uint32_t)((int32_t)nearbyintf(f[ip->rs1]));
+    r[0] = 0;
+    NEXT();
+op_fcvt_s_w:
+    BEGIN(fcvt_s_w);
+    f[ip->rd] = (int32_t)r[ip->rs1];
+    NEXT();
+op_fmv_s_x:
+    BEGIN(fmv_s_x);
+    F_RESULT(ip->rd, bits_to_float(r[ip->rs1]), fmv_s_x(ip->rd, ip->rs1));
+    // I type
+op_addi:
+    BEGIN(addi);
+    r[ip->rd] = r[ip->rs1] + ip->imm;
+    r[0] = 0;
+    NEXT();
+op_slli:
+    BEGIN(slli);
+    r[ip->rd] = r[ip->rs1] << ip->imm;
+    r[0] = 0;
+    NEXT();
+op_srai:
+    BEGIN(srai);
+    r[ip->rd] = (uint32_t)((int32_t)r[ip->rs1] >> ip->imm);
+    r[0] = 0;
+    NEXT();
+op_lw:
+    BEGIN(lw);
+    {
+        ea = r[ip->rs1] + ip->imm;
+        uint32_t idx = ea >> 2;
+        if (!(idx < mem_size))
+            SLOW_PATH(lw(ip->rd, ip->rs1, ip->imm));
+        r[ip->rd] = mem[idx];
+        r[0] = 0;
+    }
+    NEXT();
+op_flw:
+    BEGIN(flw);
+    {
+        ea = r[ip->rs1] + ip->imm;
+        uint32_t idx = ea >> 2;
+        if (!(idx < mem_size))
+            SLOW_PATH(flw(ip->rd, ip->rs1, ip->imm));
+        F_RESULT(ip->rd, bits_to_float(mem[idx]), flw(ip->rd, ip->rs1, ip->imm));
+    }
+op_jalr:
+    BEGIN(jalr);
+    r[ip->rd] = pc + WORD_SIZE;
+    r[0] = 0;
+    JUMP(r[ip->rs1] + ip->imm);
+    // S type
+op_sw:
+    BEGIN(sw);
+    {
+        ea = r[ip->rs1] + ip->imm;
+        uint32_t idx = ea >> 2;
+        if (!(idx < mem_size))
+            SLOW_PATH(sw(ip->rs2, ip->rs1, ip->imm));
+        mem[idx] = r[ip->rs2];
+    }
+    NEXT();
+op_fsw:
+    BEGIN(fsw);
+    {
+        ea = r[ip->rs1] + ip->imm;
+        uint32_t idx = ea >> 2;
+        if (!(idx < mem_size))
+            SLOW_PATH(fsw(ip->rs2, ip->rs1, ip->imm));
+        mem[idx] = float_to_bits(f[ip->rs2]);
+    }
+    NEXT();
+    // SB type
+op_beq:
+    BEGIN(beq);
+    if (r[ip->rs1] == r[ip->rs2])
+        JUMP(pc + ip->imm);
+    NEXT();
+op_bne:
+    BEGIN(bne);
+    if (r[ip->rs1] != r[ip->rs2])
+        JUMP(pc + ip->imm);
+    NEXT();
+op_blt:
+    BEGIN(blt);
+    if ((int32_t)r[ip->rs1] < (int32_t)r[ip->rs2])
+        JUMP(pc + ip->imm);
+    NEXT();
+op_bge:
+    BEGIN(bge);
+    if ((int32_t)r[ip->rs1] >= (int32_t)r[ip->rs2])
+        JUMP(pc + ip->imm);
+    NEXT();
+    // U type
+op_lui:
+    BEGIN(lui);
+    r[ip->rd] = (uint32_t)ip->imm | (r[ip->rd] & 0x00000fff); // preserve the lowest 12 bits
+    r[0] = 0;
+    NEXT();
+    // UJ type
+op_jal:
+    BEGIN(jal);
+    r[ip->rd] = pc + WORD_SIZE;
+    r[0] = 0;
+    JUMP(pc + ip->imm);
+    // original
+op_halt:
+    BEGIN(halt);
+    NOTIFY(pc, pc);
+    halted_f = true;
+    RETIRE();
+    goto leave;
+op_inb:
+    BEGIN(inb);
+    r[ip->rd] = io->get(); // clears upper 24 bits
+    r[0] = 0;
+    NEXT();
+op_outb:
+    BEGIN(outb);
+    io->put((char)r[ip->rs1]);
+    if (exception_f) { // the output differs from the expected one; stop after this outb
+        NOTIFY(pc, pc + WORD_SIZE);
+        RETIRE();
+        prev_pc = pc;
+        pc += WORD_SIZE;
+        goto leave;
+    }
+    NEXT();
+
+op_invalid:
+    if (features & FEAT_COUNT)
+        exec_count[ip - code]++;
+    print_line(pc);
+    log() << "Invalid instruction." << endl << endl;
+    res = false;
+    goto leave;
+
+out_of_range:
+    print_line(prev_pc);
+    log() << "PC is out of range." << endl << endl;
+    res = false;
+    goto leave;
+
+leave:
+    SAVE_STATE();
+    return res;
+
+#undef SAVE_STATE
+#undef LOAD_STATE
+#undef RETIRE
+#undef DISPATCH
+#undef CHECK_BREAK
+#undef NOTIFY
+#undef NEXT
+#undef JUMP
+#undef BEGIN
+#undef SLOW_PATH
+#undef F_RESULT
+}
+
+template <unsigned... fs>
+static CPU::RunLoop pick_threaded_loop(unsigned features, integer_sequence<unsigned, fs...>)
+{
+    static const CPU::RunLoop loops[] = {&CPU::run_threaded<fs>...};
+    return loops[features];
+}
+
+CPU::RunLoop CPU::threaded_loop(unsigned features)
+{
+    return pick_threaded_loop(features & FEAT_ALL, make_integer_sequence<unsigned, FEAT_ALL + 1>());
+}
@@ -0,0 +1,160 @@
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+#include "common.h"
+
+// x0 and missing sources read slot 0, which stays ready; results to x0 or
+// nowhere go to the sink slot
+static uint8_t src_slot(RegKind kind, uint32_t ri)
+{
+    return kind == RegKind::f ? 32 + ri : kind == RegKind::x ? ri : 0;
+}
+
+static uint8_t dst_slot(RegKind kind, uint32_t ri)
+{
+    if (kind == RegKind::none || (kind == RegKind::x && ri == 0))
+        return TimingModel::SINK;
+    return src_slot(kind, ri);
+}
+
+static TimingModel::Stall hazard_class(InstType t)
+{
+    if (t == InstType::lw || t == InstType::flw)
+        return TimingModel::load_use;
+    if (t >= InstType::fadd && t <= InstType::fmv_s_x)
+        return TimingModel::fpu;
+    return TimingModel::other_data;
+}
+
+static const char *const stall_names[] = {
+    "load-use", "fpu", "other data", "multi-cycle", "taken branch", "jal", "jalr",
+};
+
+TimingModel::TimingModel(Simulator *sim) : sim(sim), insts(0), cycles(0)
+{
+    fill(latency, latency + INST_LEN, 1);
+    fill(issue_cycles, issue_cycles + INST_LEN, 1);
+    fill(penalty, penalty + STALL_LEN, 0);
+    fill(stalls, stalls + STALL_LEN, 0);
+    fill(ready, ready + SINK + 1, 0);
+    fill(producer, producer + SINK + 1, other_data);
+
+    for (const DecodedInst &inst : sim->insts()) {
+        Operands ops = operands_of(inst.type);
+        TimedInst ti;
+        ti.type = inst.type;
+        ti.src[0] = src_slot(ops.rs1, inst.rs1);
+        ti.src[1] = src_slot(ops.rs2, inst.rs2);
+        ti.src[2] = inst.type == InstType::lui ? src_slot(RegKind::x, inst.rd) : 0;
+        ti.dst = dst_slot(ops.rd, inst.rd);
+        ti.hazard = hazard_class(inst.type);
+        if (inst.type >= InstType::beq && inst.type <= InstType::bge)
+            ti.control = taken_branch;
+        else if (inst.type == InstType::jal)
+            ti.control = jal;
+        else if (inst.type == InstType::jalr)
+            ti.control = jalr;
+        else
+            ti.control = STALL_LEN;
+        timed_insts.push_back(ti);
+    }
+}
+
+// lines of "MNEMONIC LATENCY [ISSUE_CYCLES]" or "penalty taken-branch|jal|jalr CYCLES"
+bool TimingModel::load_config(const string &name, string &error)
+{
+    ifstream ifs(name);
+    if (!ifs) {
+        error = "cannot open timing config";
+        return false;
+    }
+
+    string line;
+    for (int lnum = 1; getline(ifs, line); lnum++) {
+        line = line.substr(0, line.find('#'));
+        vector<string> words = split_string(line, " \t\r");
+        if (words.empty())
+            continue;
+
+        bool ok = false;
+        try {
+            if (words[0] == "penalty" && words.size() == 3) {
+                const string kinds[] = {"taken-branch", "jal", "jalr"};
+                for (int k = 0; k < 3; k++) {
+                    if (words[1] == kinds[k]) {
+                        penalty[taken_branch + k] = stoul(words[2]);
+                        ok = true;
+                    }
+                }
+            } else if (words.size() == 2 || words.size() == 3) {
+                for (int i = 0; i < INST_LEN; i++) {
+                    if (words[0] != inst_type_to_string(static_cast<InstType>(i)))
+                        continue;
+                    latency[i] = stoul(words[1]);
+                    if (words.size() == 3)
+                        issue_cycles[i] = stoul(words[2]);
+                    ok = latency[i] >= 1 && issue_cycles[i] >= 1;
+                }
+            }
+        } catch (logic_error &) { // stoul
+            ok = false;
+        }
+        if (!ok) {
+            error = "invalid timing config at line " + to_string(lnum);
+            return false;
+        }
+    }
+    return true;
+}
+
+void TimingModel::retire(const RetireEvent &e)
+{
+    const TimedInst &ti = timed_insts[e.pc >> 2];
+    const int t = static_cast<int>(ti.type);
+
+    // wait for the source operands
+    uint64_t issue = cycles;
+    Stall cause = other_data;
+    for (uint8_t s : ti.src) {
+        if (ready[s] > issue) {
+            issue = ready[s];
+            cause = producer[s];
+        }
+    }
+    stalls[cause] += issue - cycles;
+
+    cycles = issue + issue_cycles[t];
+    stalls[multi_cycle] += issue_cycles[t] - 1;
+
+    ready[ti.dst] = issue + latency[t];
+    producer[ti.dst] = ti.hazard;
+
+    if (ti.control != STALL_LEN && (ti.control != taken_branch || e.next_pc != e.pc + WORD_SIZE)) {
+        cycles += penalty[ti.control];
+        stalls[ti.control] += penalty[ti.control];
+    }
+
+    insts++;
+}
+
+void TimingModel::print()
+{
+    ostream &log = sim->log();
+    log << endl << "[Timing model]" << endl;
+    log << insts << " instructions, " << cycles << " estimated cycles (CPI "
+         << fixed << setprecision(2) << (insts ? (double)cycles / insts : 0.0) << defaultfloat << ")." << endl << endl;
+
+    log << setw(14) << setfill(' ') << "stall cycles" << "       %  cause" << endl;
+    for (int i = 0; i < STALL_LEN; i++) {
+        log << setw(14) << setfill(' ') << stalls[i] << "  "
+             << fixed << setprecision(2) << setw(6) << (cycles ? 100.0 * stalls[i] / cycles : 0.0) << "%" << defaultfloat
+             << "  " << stall_names[i] << endl;
+    }
+}
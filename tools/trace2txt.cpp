@@ -0,0 +1,79 @@
+// converts a -trace file to text, one line per retired instruction:
+//   PC  [xN|fN = VALUE]  [@ADDR]
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+#include "../common.h"
+
+static bool get_varint(istream &is, int32_t &delta)
+{
+    uint32_t n = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int c = is.get();
+        if (c == EOF)
+            return false;
+        n |= (uint32_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            delta = (int32_t)((n >> 1) ^ -(n & 1)); // zigzag
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        cerr << "usage: " << argv[0] << " TRACE" << endl;
+        return 1;
+    }
+
+    ifstream ifs(argv[1], ios::binary);
+    char magic[sizeof(TRACE_MAGIC)];
+    if (!ifs || !ifs.read(magic, sizeof(magic)) || string(magic, sizeof(magic)) != string(TRACE_MAGIC, sizeof(TRACE_MAGIC))) {
+        cerr << "error: not a trace file" << endl;
+        return 1;
+    }
+
+    uint32_t pc = -4, addr = 0;
+    uint32_t regs[2][32] = {};
+    int c;
+    while ((c = ifs.get()) != EOF) {
+        uint8_t flags = c;
+        int32_t delta = 0;
+        bool ok = true;
+
+        pc += 4;
+        if (flags & TRACE_JUMP) {
+            ok = get_varint(ifs, delta);
+            pc += delta;
+        }
+        printf("%08x", pc);
+        if (ok && (flags & (TRACE_REG | TRACE_FREG))) {
+            int rd = ifs.get();
+            ok = rd != EOF && rd < 32 && get_varint(ifs, delta);
+            if (ok) {
+                uint32_t &value = regs[(flags & TRACE_FREG) ? 1 : 0][rd];
+                value += delta;
+                printf("  %c%-2d = %08x", (flags & TRACE_FREG) ? 'f' : 'x', rd, value);
+            }
+        }
+        if (ok && (flags & TRACE_MEM)) {
+            ok = get_varint(ifs, delta);
+            addr += delta;
+            printf("  @%08x", addr);
+        }
+        printf("\n");
+        if (!ok) {
+            cerr << "error: trace is truncated" << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <vector>
+#include <string>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+
+using namespace std;
+
+#include "common.h"
+
+const size_t TRACE_BUF_SIZE = 1 << 20;
+const int TRACE_IDLE_POLLS = 1024; // before the writer sleeps on an empty ring
+const int TRACE_WAIT_MS = 10; // bounds a wakeup lost to the race with retire
+
+static const vector<Operands> operand_table = []() {
+    vector<Operands> table;
+    for (int i = 0; i <= INST_LEN; i++)
+        table.push_back(operands_of(static_cast<InstType>(i)));
+    return table;
+}();
+
+static uint8_t *put_varint(uint8_t *p, int32_t delta)
+{
+    uint32_t n = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31); // zigzag
+    while (n >= 0x80) {
+        *p++ = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    *p++ = n;
+    return p;
+}
+
+bool TraceWriter::open(const string &name)
+{
+    ofs.open(name, ios::binary);
+    if (!ofs)
+        return false;
+    ofs.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    is_ok = true;
+    writer = thread(&TraceWriter::write_loop, this);
+    return true;
+}
+
+TraceRecord make_trace_record(const RetireEvent &e)
+{
+    TraceRecord rec;
+    rec.pc = e.pc;
+    rec.flags = 0;
+    rec.rd = e.inst->rd;
+    rec.value = 0;
+    rec.mem_addr = e.mem_addr;
+
+    InstType t = e.inst->type;
+    bool is_mem = t == InstType::lw || t == InstType::flw || t == InstType::sw || t == InstType::fsw;
+    if (is_mem)
+        rec.flags |= TRACE_MEM;
+    if (!is_mem || e.next_pc != e.pc) { // a faulting load writes nothing
+        const Operands &ops = operand_table[static_cast<int>(t)];
+        if (ops.rd == RegKind::x && rec.rd != 0) {
+            rec.flags |= TRACE_REG;
+            rec.value = e.r[rec.rd];
+        } else if (ops.rd == RegKind::f) {
+            rec.flags |= TRACE_FREG;
+            memcpy(&rec.value, &e.f[rec.rd], sizeof(rec.value));
+        }
+    }
+    return rec;
+}
+
+void TraceWriter::retire(const RetireEvent &e)
+{
+    TraceRecord rec = make_trace_record(e);
+
+    uint64_t h = head.load(memory_order_relaxed);
+    while (h - cached_tail >= RING_LEN) {
+        cached_tail = tail.load(memory_order_acquire);
+        if (h - cached_tail >= RING_LEN)
+            this_thread::yield();
+    }
+    ring[h & (RING_LEN - 1)] = rec;
+    head.store(h + 1, memory_order_release);
+    if (is_waiting.load(memory_order_relaxed) && is_waiting.exchange(false)) { // was empty
+        lock_guard<mutex> lock(mtx);
+        wakeup.notify_one();
+    }
+}
+
+void TraceWriter::write_loop()
+{
+    const size_t max_record = 1 + 5 + 1 + 5 + 5;
+    vector<uint8_t> buf(TRACE_BUF_SIZE + max_record);
+    uint8_t *p = buf.data(), *const buf_end = buf.data() + TRACE_BUF_SIZE;
+    uint32_t prev_pc = -WORD_SIZE, prev_addr = 0;
+    uint32_t prev_regs[2][32] = {};
+
+    uint64_t t = tail.load(memory_order_relaxed);
+    int idle_polls = 0;
+    for (;;) {
+        uint64_t h = head.load(memory_order_acquire);
+        if (t == h) {
+            if (is_done.load(memory_order_acquire) && head.load(memory_order_acquire) == t)
+                break;
+            if (++idle_polls < TRACE_IDLE_POLLS) {
+                this_thread::yield();
+                continue;
+            }
+            // nothing to write for a while, e.g. at the debugger prompt
+            unique_lock<mutex> lock(mtx);
+            is_waiting.store(true);
+            if (head.load() == t && !is_done.load())
+                wakeup.wait_for(lock, chrono::milliseconds(TRACE_WAIT_MS));
+            is_waiting.store(false, memory_order_relaxed);
+            continue;
+        }
+        idle_polls = 0;
+
+        for (; t != h; t++) {
+            const TraceRecord &rec = ring[t & (RING_LEN - 1)];
+            uint8_t flags = rec.flags;
+            if (rec.pc != prev_pc + WORD_SIZE)
+                flags |= TRACE_JUMP;
+            *p++ = flags;
+            if (flags & TRACE_JUMP)
+                p = put_varint(p, rec.pc - (prev_pc + WORD_SIZE));
+            if (flags & (TRACE_REG | TRACE_FREG)) {
+                uint32_t &prev = prev_regs[(flags & TRACE_FREG) ? 1 : 0][rec.rd];
+                *p++ = rec.rd;
+                p = put_varint(p, rec.value - prev);
+                prev = rec.value;
+            }
+            if (flags & TRACE_MEM) {
+                p = put_varint(p, rec.mem_addr - prev_addr);
+                prev_addr = rec.mem_addr;
+            }
+            prev_pc = rec.pc;
+
+            if (p >= buf_end) {
+                ofs.write((const char *)buf.data(), p - buf.data());
+                p = buf.data();
+            }
+        }
+        tail.store(t, memory_order_release);
+    }
+
+    ofs.write((const char *)buf.data(), p - buf.data());
+    ofs.flush();
+    is_ok = bool(ofs);
+}
+
+bool TraceWriter::close()
+{
+    if (!writer.joinable())
+        return is_ok;
+    is_done.store(true, memory_order_release);
+    {
+        lock_guard<mutex> lock(mtx);
+        wakeup.notify_one();
+    }
+    writer.join();
+    ofs.close();
+    return is_ok;
+}
@@ -0,0 +1,58 @@
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+#include "common.h"
+
+UndoLog::UndoLog(CPU *cpu, const vector<DecodedInst> &dinsts, size_t capacity)
+    : cpu(cpu), dinsts(dinsts), targets(dinsts.size(), SLOT_NONE), ring(capacity)
+{
+    for (uint32_t i = 0; i < dinsts.size(); i++) {
+        InstType t = dinsts[i].type;
+        if (t == InstType::sentinel)
+            continue;
+        RegKind rd = operands_of(t).rd;
+        if (rd == RegKind::x && dinsts[i].rd != 0)
+            targets[i] = dinsts[i].rd;
+        else if (rd == RegKind::f)
+            targets[i] = 32 + dinsts[i].rd;
+        else if (t == InstType::sw || t == InstType::fsw)
+            targets[i] = WHERE_MEM;
+        if (t == InstType::inb)
+            targets[i] |= WHERE_INPUT;
+    }
+    clear();
+}
+
+void UndoLog::clear()
+{
+    next = 0;
+    len = 0;
+}
+
+bool UndoLog::step_back()
+{
+    if (len == 0)
+        return false;
+    next = (next == 0 ? ring.size() : next) - 1;
+    len--;
+    const Entry &en = ring[next];
+
+    if (en.where & WHERE_MEM)
+        cpu->set_mem_word(en.where & ~WHERE_MEM, en.old);
+    else {
+        uint32_t slot = en.where & ~WHERE_INPUT;
+        if (slot < 32)
+            cpu->set_r(slot, en.old);
+        else if (slot < 64)
+            cpu->set_f_bits(slot - 32, en.old);
+        if (en.where & WHERE_INPUT)
+            cpu->get_io()->unget();
+    }
+
+    uint32_t prev_pc = len > 0 ? ring[(next == 0 ? ring.size() : next) - 1].pc : en.pc;
+    cpu->unretire(en.pc, prev_pc);
+    return true;
+}
@@ -37,18 +37,18 @@ string num_to_bin(uint32_t num, int len = 32)
     return bin;
 }
 
-void print_hex(uint32_t n)
+void print_hex(uint32_t n, ostream &os)
 {
-    cerr << "0x" << hex << setw(8) << setfill('0') << n << dec;
+    os << "0x" << hex << setw(8) << setfill('0') << n << dec;
 }
 
-void print_dec_2(uint32_t n)
+void print_dec_2(uint32_t n, ostream &os)
 {
-    cerr << setw(2) << setfill('0') << n;
+    os << setw(2) << setfill('0') << n;
 }
 
-void print_dec_10(uint32_t n)
+void print_dec_10(uint32_t n, ostream &os)
 {
-    cerr << setw(10) << setfill(' ') << n;
+    os << setw(10) << setfill(' ') << n;
 }
 
@@ -0,0 +1,111 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+#include "common.h"
+
+const size_t WATCHDOG_MAX_STATES = 1 << 16; // forgotten when full
+const size_t WATCHDOG_MAX_LINES = 20;
+
+Watchdog::Watchdog(Simulator *sim, uint64_t period)
+    : sim(sim), period(period), next(sim->get_cpu()->get_clocks() + period), in_pos(sim->io().get_in_pos()),
+      out_count(sim->io().get_out_count()), repeat_from(0), repeat_at(0), last_time(chrono::steady_clock::now())
+{
+}
+
+bool Watchdog::sample()
+{
+    auto start_time = chrono::steady_clock::now();
+    CPU *cpu = sim->get_cpu();
+    GuestIO &io = sim->io();
+    if (io.get_in_pos() != in_pos || io.get_out_count() != out_count) {
+        in_pos = io.get_in_pos();
+        out_count = io.get_out_count();
+        seen.clear();
+    }
+
+    uint64_t hash = cpu->state_hash();
+    auto it = seen.find(hash);
+    if (it != seen.end()) {
+        repeat_from = it->second;
+        repeat_at = cpu->get_clocks();
+        return true;
+    }
+    if (seen.size() >= WATCHDOG_MAX_STATES)
+        seen.clear();
+    seen[hash] = cpu->get_clocks();
+    last_counts.resize(sim->insts().size());
+    for (uint32_t i = 0; i < last_counts.size(); i++)
+        last_counts[i] = cpu->get_exec_count(i);
+
+    auto now = chrono::steady_clock::now();
+    if ((now - start_time) * 100 > start_time - last_time)
+        period *= 2;
+    last_time = now;
+    next = cpu->get_clocks() + period;
+    return false;
+}
+
+void Watchdog::report()
+{
+    ostream &log = sim->log();
+    log << "Hang detected: the state after " << repeat_at << " clocks is the same as after " << repeat_from
+        << " clocks, with no input or output in between." << endl;
+
+    // The last sample is not before repeat_from, so everything run since
+    // then is part of the loop; the guest is not run any further.
+    CPU *cpu = sim->get_cpu();
+    vector<uint32_t> idxs;
+    for (uint32_t i = 0; i < last_counts.size(); i++) {
+        if (cpu->get_exec_count(i) != last_counts[i])
+            idxs.push_back(i);
+    }
+    log << "Looping lines (" << idxs.size() << "):" << endl;
+    size_t n = 0;
+    for (uint32_t idx : idxs) {
+        if (n++ == WATCHDOG_MAX_LINES) {
+            log << "..." << endl;
+            break;
+        }
+        sim->print_line(idx << 2);
+    }
+    log << endl;
+}
+
+bool run_budgeted(Simulator *sim, uint64_t max_clocks, bool is_watchdog, bool &is_stopped, uint64_t checkpoint_at,
+                  const function<void()> &at_checkpoint)
+{
+    CPU *cpu = sim->get_cpu();
+    Watchdog watchdog(sim);
+    is_stopped = false;
+    for (;;) {
+        if (cpu->get_clocks() == checkpoint_at) {
+            at_checkpoint();
+            checkpoint_at = UINT64_MAX;
+        }
+        if (is_watchdog && cpu->get_clocks() >= watchdog.next_sample() && watchdog.sample()) {
+            watchdog.report();
+            break;
+        }
+        if (cpu->get_clocks() >= max_clocks) {
+            sim->log() << "The budget of " << max_clocks << " clocks is used up." << endl << endl;
+            break;
+        }
+        uint64_t until = min(checkpoint_at, max_clocks);
+        if (is_watchdog)
+            until = min(until, watchdog.next_sample());
+        if (!sim->run(until))
+            return false;
+        if (cpu->is_halted() || cpu->is_exception())
+            return true;
+    }
+    is_stopped = true;
+    cpu->raise_exception();
+    return true;
+}
@@ -0,0 +1,186 @@
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "common.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "sections of a .zoi image are used in place and need a little-endian host"
+#endif
+
+// layout: magic, data_len, text_len, data[data_len], text[text_len],
+// and for ZOI? also inst_lines[text_len] followed by the source text
+static const size_t HEADER_SIZE = 3 * 4;
+
+ZoiImage::~ZoiImage()
+{
+    close();
+}
+
+bool ZoiImage::open(const string &name)
+{
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    size = st.st_size;
+    if (size > 0) {
+        void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        base = static_cast<const uint8_t *>(p);
+    }
+    ::close(fd);
+    return true;
+}
+
+void ZoiImage::close()
+{
+    if (base)
+        munmap(const_cast<uint8_t *>(base), size);
+    base = nullptr;
+    size = 0;
+}
+
+bool ZoiImage::has_valid_magic() const
+{
+    return size >= HEADER_SIZE && memcmp(base, "ZOI", 3) == 0 && (base[3] == '!' || base[3] == '?');
+}
+
+uint32_t ZoiImage::word_at(size_t offset) const
+{
+    uint32_t w;
+    memcpy(&w, base + offset, sizeof(w));
+    return w;
+}
+
+bool ZoiImage::is_complete() const
+{
+    size_t words = (size_t)data_len() + text_len();
+    if (has_debug_info())
+        words += text_len();
+    return size - HEADER_SIZE >= words * 4;
+}
+
+uint64_t ZoiImage::content_hash() const
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ base[i]) * 0x100000001b3;
+    return hash;
+}
+
+const uint32_t *ZoiImage::data() const
+{
+    return reinterpret_cast<const uint32_t *>(base + HEADER_SIZE);
+}
+
+const uint32_t *ZoiImage::text() const
+{
+    return data() + data_len();
+}
+
+// the debug sections end a ZOI? file; a ZOI! file has none and ends with
+// the text, so there is nothing past it to point at
+const uint32_t *ZoiImage::inst_lines() const
+{
+    if (!has_debug_info())
+        return nullptr;
+    return text() + text_len();
+}
+
+const char *ZoiImage::source() const
+{
+    if (!has_debug_info())
+        return nullptr;
+    return reinterpret_cast<const char *>(inst_lines() + text_len());
+}
+
+size_t ZoiImage::source_len() const
+{
+    if (!has_debug_info())
+        return 0;
+    return base + size - reinterpret_cast<const uint8_t *>(source());
+}
+
+// One pass over the source records where every line starts and which lines
+// define labels (first token ending with ':'); lines themselves are only
+// copied out when asked for. Without debug info there are no lines.
+// Built once under call_once, as the simulators sharing a Program may ask
+// at once, and never changed after, so readers need no lock afterwards.
+void ZoiImage::index_source() const
+{
+    call_once(index_once, [this]() { build_index(); });
+}
+
+void ZoiImage::build_index() const
+{
+    if (!has_debug_info())
+        return;
+
+    const char *src = source(), *end = src + source_len();
+    auto is_delim = [](char c) { return c == ' ' || c == '#' || c == '\t'; }; // as split_string(line, " #\t")
+    const char *p = src;
+    for (;;) {
+        line_offsets.push_back(p - src);
+        uint32_t lnum = line_offsets.size();
+
+        while (p != end && *p != '\n' && is_delim(*p))
+            p++;
+        const char *tok = p;
+        while (p != end && *p != '\n' && !is_delim(*p))
+            p++;
+        if (p > tok && p[-1] == ':') {
+            string label(tok, p - 1);
+            label_names.push_back(label);
+            label_index[label] = lnum;
+        }
+
+        p = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!p)
+            break;
+        p++;
+    }
+}
+
+string ZoiImage::source_line(uint32_t lnum) const
+{
+    index_source();
+    if (lnum == 0 || lnum > line_offsets.size())
+        return "";
+    const char *src = source();
+    size_t begin = line_offsets[lnum - 1];
+    size_t end = lnum < line_offsets.size() ? line_offsets[lnum] - 1 : source_len();
+    return string(src + begin, src + end);
+}
+
+bool ZoiImage::find_label(const string &label, uint32_t &lnum) const
+{
+    index_source();
+    auto it = label_index.find(label);
+    if (it == label_index.end())
+        return false;
+    lnum = it->second;
+    return true;
+}
+
+const vector<string> &ZoiImage::labels() const
+{
+    index_source();
+    return label_names;
+}